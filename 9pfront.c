@@ -19,6 +19,61 @@
 #ifdef HAVE_LIBC
 
 #define N_REQS   64
+#define MAX_9PFS_RINGS   2
+#define N_FIDS   1024
+#define FID_MAP_BITS     (8 * sizeof(unsigned long))
+#define WALK_CACHE_SIZE  16
+#define P9_CACHE_PAGES      64
+#define P9_CACHE_HASH       16
+#define P9_CACHE_READAHEAD   8  /* Maximum pages read on a cache miss. */
+
+/*
+ * Cached fid of a directory, indexed by its path relative to the mount
+ * point. Cached fids are never opened, so they can serve as starting point
+ * for further walks.
+ */
+struct walk_cache {
+    char *path;                 /* NULL == unused entry. */
+    uint32_t fid;
+    unsigned int users;         /* Entry can't be evicted while in use. */
+    bool stale;                 /* Path removed, drop entry when unused. */
+    unsigned long lru;
+};
+
+struct cache_page {
+    struct cache_page *next;    /* Hash chain. */
+    bool hashed;                /* false == unused page. */
+    uint64_t path;              /* qid path of the file. */
+    uint32_t version;           /* qid version when the page was read. */
+    uint64_t index;             /* Page index in the file. */
+    unsigned char *data;
+    unsigned int valid;         /* Valid bytes, less than PAGE_SIZE at EOF. */
+    unsigned int dirty_start;   /* Dirty range in write-back mode. */
+    unsigned int dirty_end;
+    unsigned long dirty_seq;    /* Incremented on each write-back mode write. */
+    uint32_t fid;               /* Fid for writing back dirty data. */
+    unsigned long lru;
+};
+
+/* Upper limit for the ring order negotiated with the backend. */
+#define MAX_9PFS_RING_ORDER      6
+
+struct ring_9pfs {
+    struct dev_9pfs *dev;
+
+    struct xen_9pfs_data_intf *intf;
+    struct xen_9pfs_data data;
+    RING_IDX prod_pvt_out;
+    RING_IDX cons_pvt_in;
+
+    grant_ref_t ring_ref;
+    grant_ref_t data_ref[1 << MAX_9PFS_RING_ORDER]; /* Copy of intf->ref. */
+    evtchn_port_t evtchn;
+
+    struct wait_queue_head waitq;
+    struct semaphore ring_out_sem;
+    struct semaphore ring_in_sem;
+};
 
 struct dev_9pfs {
     int id;
@@ -29,15 +84,12 @@ struct dev_9pfs {
     char *tag;
     const char *mnt;
     unsigned int msize_max;
+    bool dotl;                  /* 9P2000.L negotiated. */
 
-    struct xen_9pfs_data_intf *intf;
-    struct xen_9pfs_data data;
-    RING_IDX prod_pvt_out;
-    RING_IDX cons_pvt_in;
-
-    grant_ref_t ring_ref;
-    evtchn_port_t evtchn;
-    unsigned int ring_order;
+    unsigned int ring_order;    /* Same for all rings. */
+    unsigned int num_rings;
+    unsigned int next_ring;
+    struct ring_9pfs rings[MAX_9PFS_RINGS];
     xenbus_event_queue events;
 
     unsigned int free_reqs;
@@ -45,27 +97,50 @@ struct dev_9pfs {
         unsigned int id;
         unsigned int next_free;     /* N_REQS == end of list. */
         unsigned int cmd;
+        unsigned int ring;          /* Ring the request was sent on. */
         int result;
         bool inflight;
         unsigned char *data;        /* Returned data. */
+        unsigned char *rbuf;        /* Direct buffer for Rread payload. */
+        uint32_t rlen;              /* Size of rbuf, then bytes received. */
     } req[N_REQS];
 
-    struct wait_queue_head waitq;
-    struct semaphore ring_out_sem;
-    struct semaphore ring_in_sem;
+    unsigned long fid_map[N_FIDS / FID_MAP_BITS];  /* Set bits: free fids. */
+
+    struct walk_cache walk_cache[WALK_CACHE_SIZE];
+    unsigned long walk_cache_clock;
 
-    unsigned long long fid_mask;              /* Bit mask for free fids. */
+    unsigned int cache_mode;
+    struct cache_page cache[P9_CACHE_PAGES];
+    struct cache_page *cache_hash[P9_CACHE_HASH];
+    unsigned long cache_clock;
+    unsigned long cache_gen;    /* Incremented on writes to cached files. */
 };
 
 struct file_9pfs {
     uint32_t fid;
     struct dev_9pfs *dev;
     bool append;
+    bool readable;              /* Not O_WRONLY, can fill cache pages. */
+    bool regular;               /* Regular file, can use the page cache. */
+    uint64_t qpath;
+    uint32_t qversion;
 };
 
-#define DEFAULT_9PFS_RING_ORDER  4
+/* Maximum number of concurrent requests for a single read or write. */
+#define P9_RW_PIPELINE           4
 
-/* P9 protocol commands (response is either cmd+1 or P9_CMD_ERROR). */
+/*
+ * P9 protocol commands (response is either cmd+1 or P9_CMD_ERROR, which is
+ * replaced by P9_CMD_LERROR for 9P2000.L).
+ */
+#define P9_CMD_LERROR       7
+#define P9_CMD_LOPEN       12
+#define P9_CMD_LCREATE     14
+#define P9_CMD_GETATTR     24
+#define P9_CMD_READDIR     40
+#define P9_CMD_FSYNC       50
+#define P9_CMD_UNLINKAT    76
 #define P9_CMD_VERSION    100
 #define P9_CMD_ATTACH     104
 #define P9_CMD_ERROR      107
@@ -75,6 +150,7 @@ struct file_9pfs {
 #define P9_CMD_READ       116
 #define P9_CMD_WRITE      118
 #define P9_CMD_CLUNK      120
+#define P9_CMD_REMOVE     122
 #define P9_CMD_STAT       124
 
 /* P9 protocol open flags. */
@@ -83,9 +159,24 @@ struct file_9pfs {
 #define P9_ORDWR            2   /* read and write */
 #define P9_OTRUNC          16   /* or'ed in, truncate file first */
 
+/* 9P2000.L open flags (Linux values, independent of the libc ones). */
+#define P9_DOTL_RDONLY      00
+#define P9_DOTL_WRONLY      01
+#define P9_DOTL_RDWR        02
+#define P9_DOTL_CREATE    0100
+#define P9_DOTL_TRUNC    01000
+
+/* 9P2000.L unlinkat flags. */
+#define P9_DOTL_AT_REMOVEDIR  0x200
+
+/* 9P2000.L getattr request mask: all fields of struct stat. */
+#define P9_GETATTR_BASIC  0x000007ffULL
+
 #define P9_QID_SIZE    13
+#define P9_MAXWELEM    16       /* Maximum number of names in one walk. */
 
 #define QID_TYPE_DIR   0x80     /* Applies to qid[0]. */
+#define QID_TYPE_FILE  0x00
 
 struct p9_header {
     uint32_t size;
@@ -93,6 +184,14 @@ struct p9_header {
     uint16_t tag;
 } __attribute__((packed));
 
+/* Fixed part of Tread and Twrite. */
+struct p9_rw_header {
+    struct p9_header hdr;
+    uint32_t fid;
+    uint64_t offset;
+    uint32_t count;
+} __attribute__((packed));
+
 struct p9_stat {
     uint16_t size;
     uint16_t type;
@@ -112,7 +211,32 @@ struct p9_stat {
     uint32_t n_muid;
 };
 
-#define P9_VERSION        "9P2000.u"
+/* Fixed size 9P2000.L attributes, no strings to allocate. */
+struct p9_attr {
+    uint64_t valid;
+    uint8_t qid[P9_QID_SIZE];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t nlink;
+    uint64_t rdev;
+    uint64_t size;
+    uint64_t blksize;
+    uint64_t blocks;
+    uint64_t atime_sec;
+    uint64_t atime_nsec;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t ctime_sec;
+    uint64_t ctime_nsec;
+    uint64_t btime_sec;
+    uint64_t btime_nsec;
+    uint64_t gen;
+    uint64_t data_version;
+};
+
+#define P9_VERSION_L      "9P2000.L"
+#define P9_VERSION_U      "9P2000.u"
 #define P9_ROOT_FID       0
 
 static unsigned int ftype_9pfs;
@@ -126,21 +250,28 @@ static void free_stat(struct p9_stat *stat)
     free(stat->extension);
 }
 
+/* Fid 0 (P9_ROOT_FID) is never free, so 0 is returned if no fid is left. */
 static unsigned int get_fid(struct dev_9pfs *dev)
 {
-    unsigned int fid;
+    unsigned int i, bit;
 
-    fid = ffs(dev->fid_mask);
-    if ( fid )
-        dev->fid_mask &= ~(1ULL << (fid - 1));
+    for ( i = 0; i < ARRAY_SIZE(dev->fid_map); i++ )
+    {
+        if ( dev->fid_map[i] )
+        {
+            bit = __ffs(dev->fid_map[i]);
+            dev->fid_map[i] &= ~(1UL << bit);
+            return i * FID_MAP_BITS + bit;
+        }
+    }
 
-     return fid;
+    return 0;
 }
 
 static void put_fid(struct dev_9pfs *dev, unsigned int fid)
 {
     if ( fid )
-        dev->fid_mask |= 1ULL << (fid - 1);
+        dev->fid_map[fid / FID_MAP_BITS] |= 1UL << (fid % FID_MAP_BITS);
 }
 
 static struct req *get_free_req(struct dev_9pfs *dev)
@@ -161,49 +292,74 @@ static void put_free_req(struct dev_9pfs *dev, struct req *req)
     req->next_free = dev->free_reqs;
     req->inflight = false;
     req->data = NULL;
+    req->rbuf = NULL;
     dev->free_reqs = req->id;
 }
 
-static unsigned int ring_out_free(struct dev_9pfs *dev)
+static unsigned int ring_out_free(struct ring_9pfs *ring)
 {
-    RING_IDX ring_size = XEN_FLEX_RING_SIZE(dev->ring_order);
+    RING_IDX ring_size = XEN_FLEX_RING_SIZE(ring->dev->ring_order);
     unsigned int queued;
 
-    queued = xen_9pfs_queued(dev->prod_pvt_out, dev->intf->out_cons, ring_size);
+    queued = xen_9pfs_queued(ring->prod_pvt_out, ring->intf->out_cons, ring_size);
     rmb();
 
     return ring_size - queued;
 }
 
-static unsigned int ring_in_data(struct dev_9pfs *dev)
+static unsigned int ring_in_data(struct ring_9pfs *ring)
 {
-    RING_IDX ring_size = XEN_FLEX_RING_SIZE(dev->ring_order);
+    RING_IDX ring_size = XEN_FLEX_RING_SIZE(ring->dev->ring_order);
     unsigned int queued;
 
-    queued = xen_9pfs_queued(dev->intf->in_prod, dev->cons_pvt_in, ring_size);
+    queued = xen_9pfs_queued(ring->intf->in_prod, ring->cons_pvt_in, ring_size);
     rmb();
 
     return queued;
 }
 
-static void copy_to_ring(struct dev_9pfs *dev, void *data, unsigned int len)
+static void copy_to_ring(struct ring_9pfs *ring, void *data, unsigned int len)
 {
-    RING_IDX ring_size = XEN_FLEX_RING_SIZE(dev->ring_order);
-    RING_IDX prod = xen_9pfs_mask(dev->prod_pvt_out, ring_size);
-    RING_IDX cons = xen_9pfs_mask(dev->intf->out_cons, ring_size);
+    RING_IDX ring_size = XEN_FLEX_RING_SIZE(ring->dev->ring_order);
+    RING_IDX prod = xen_9pfs_mask(ring->prod_pvt_out, ring_size);
+    RING_IDX cons = xen_9pfs_mask(ring->intf->out_cons, ring_size);
 
-    xen_9pfs_write_packet(dev->data.out, data, len, &prod, cons, ring_size);
-    dev->prod_pvt_out += len;
+    xen_9pfs_write_packet(ring->data.out, data, len, &prod, cons, ring_size);
+    ring->prod_pvt_out += len;
 }
 
-static void copy_from_ring(struct dev_9pfs *dev, void *data, unsigned int len)
+static void copy_from_ring(struct ring_9pfs *ring, void *data, unsigned int len)
 {
-    RING_IDX ring_size = XEN_FLEX_RING_SIZE(dev->ring_order);
-    RING_IDX prod = xen_9pfs_mask(dev->intf->in_prod, ring_size);
-    RING_IDX cons = xen_9pfs_mask(dev->cons_pvt_in, ring_size);
+    RING_IDX ring_size = XEN_FLEX_RING_SIZE(ring->dev->ring_order);
+    RING_IDX prod = xen_9pfs_mask(ring->intf->in_prod, ring_size);
+    RING_IDX cons = xen_9pfs_mask(ring->cons_pvt_in, ring_size);
+
+    xen_9pfs_read_packet(data, ring->data.in, len, prod, &cons, ring_size);
+    ring->cons_pvt_in += len;
+}
+
+/* Spread requests across all rings, the response arrives on the same ring. */
+static struct ring_9pfs *ring_select(struct dev_9pfs *dev, struct req *req)
+{
+    req->ring = dev->next_ring;
+    if ( ++dev->next_ring == dev->num_rings )
+        dev->next_ring = 0;
+
+    return dev->rings + req->ring;
+}
+
+/* Publish a request written to the ring, must be called with ring_out_sem. */
+static void send_9p_done(struct dev_9pfs *dev, struct req *req)
+{
+    struct ring_9pfs *ring = dev->rings + req->ring;
+
+    wmb();   /* Data on ring must be seen before updating index. */
+    ring->intf->out_prod = ring->prod_pvt_out;
+    req->inflight = true;
 
-    xen_9pfs_read_packet(data, dev->data.in, len, prod, &cons, ring_size);
-    dev->cons_pvt_in += len;
+    up(&ring->ring_out_sem);
+
+    notify_remote_via_evtchn(ring->evtchn);
 }
 
 /*
@@ -220,9 +376,14 @@ static void copy_from_ring(struct dev_9pfs *dev, void *data, unsigned int len)
  *    string terminated by a NUL character)
  * D: Binary data (4 byte length + <length> bytes of data), requires a length
  *    and a buffer pointer parameter.
+ * A: Array of strings (2 byte count + <count> strings), requires a count and
+ *    a string array parameter. Only valid for sending.
  * Q: A 13 byte "qid", consisting of 1 byte file type, 4 byte file version
  *    and 8 bytes unique file id. Only valid for receiving.
+ * R: Array of qids (2 byte count + <count> qids), requires a count pointer
+ *    and a buffer for P9_MAXWELEM qids. Only valid for receiving.
  */
+
 static void send_9p(struct dev_9pfs *dev, struct req *req, const char *fmt, ...)
 {
     struct p9_header hdr;
@@ -235,6 +396,9 @@ static void send_9p(struct dev_9pfs *dev, struct req *req, const char *fmt, ...)
     uint8_t byte;
     uint8_t *data;
     char *strval;
+    char **strarr;
+    unsigned int i;
+    struct ring_9pfs *ring;
 
     hdr.size = sizeof(hdr);
     hdr.cmd = req->cmd;
@@ -274,6 +438,13 @@ static void send_9p(struct dev_9pfs *dev, struct req *req, const char *fmt, ...)
             hdr.size += intval;
             data = va_arg(aq, uint8_t *);
             break;
+        case 'A':
+            hdr.size += 2;
+            intval = va_arg(aq, unsigned int);
+            strarr = va_arg(aq, char **);
+            for ( i = 0; i < intval; i++ )
+                hdr.size += 2 + strlen(strarr[i]);
+            break;
         default:
             printk("send_9p: unknown format character %c\n", *f);
             break;
@@ -285,61 +456,145 @@ static void send_9p(struct dev_9pfs *dev, struct req *req, const char *fmt, ...)
      * Waiting for free space must be done in the critical section!
      * Otherwise we might get overtaken by other short requests.
      */
-    down(&dev->ring_out_sem);
+    ring = ring_select(dev, req);
+    down(&ring->ring_out_sem);
 
-    wait_event(dev->waitq, ring_out_free(dev) >= hdr.size);
+    wait_event(ring->waitq, ring_out_free(ring) >= hdr.size);
 
-    copy_to_ring(dev, &hdr, sizeof(hdr));
+    copy_to_ring(ring, &hdr, sizeof(hdr));
     for ( f = fmt; *f; f++ )
     {
         switch ( *f )
         {
         case 'b':
             byte = va_arg(ap, unsigned int);
-            copy_to_ring(dev, &byte, sizeof(byte));
+            copy_to_ring(ring, &byte, sizeof(byte));
             break;
         case 'u':
             shortval = va_arg(ap, unsigned int);
-            copy_to_ring(dev, &shortval, sizeof(shortval));
+            copy_to_ring(ring, &shortval, sizeof(shortval));
             break;
         case 'U':
             intval = va_arg(ap, unsigned int);
-            copy_to_ring(dev, &intval, sizeof(intval));
+            copy_to_ring(ring, &intval, sizeof(intval));
             break;
         case 'L':
             longval = va_arg(ap, uint64_t);
-            copy_to_ring(dev, &longval, sizeof(longval));
+            copy_to_ring(ring, &longval, sizeof(longval));
             break;
         case 'S':
             strval = va_arg(ap, char *);
             len = strlen(strval);
-            copy_to_ring(dev, &len, sizeof(len));
-            copy_to_ring(dev, strval, len);
+            copy_to_ring(ring, &len, sizeof(len));
+            copy_to_ring(ring, strval, len);
             break;
         case 'D':
             intval = va_arg(ap, unsigned int);
-            copy_to_ring(dev, &intval, sizeof(intval));
+            copy_to_ring(ring, &intval, sizeof(intval));
             data = va_arg(ap, uint8_t *);
-            copy_to_ring(dev, data, intval);
+            copy_to_ring(ring, data, intval);
+            break;
+        case 'A':
+            intval = va_arg(ap, unsigned int);
+            strarr = va_arg(ap, char **);
+            shortval = intval;
+            copy_to_ring(ring, &shortval, sizeof(shortval));
+            for ( i = 0; i < intval; i++ )
+            {
+                len = strlen(strarr[i]);
+                copy_to_ring(ring, &len, sizeof(len));
+                copy_to_ring(ring, strarr[i], len);
+            }
             break;
         }
     }
 
-    wmb();   /* Data on ring must be seen before updating index. */
-    dev->intf->out_prod = dev->prod_pvt_out;
-    req->inflight = true;
+    va_end(ap);
+
+    send_9p_done(dev, req);
+}
 
-    up(&dev->ring_out_sem);
+/* Position in a caller's iovec array. */
+struct iov_pos {
+    const struct iovec *iov;
+    size_t off;                 /* Offset into iov->iov_base. */
+};
 
-    va_end(ap);
+static void copy_iov_to_ring(struct ring_9pfs *ring, struct iov_pos *pos,
+                             uint32_t len)
+{
+    size_t n;
+
+    while ( len )
+    {
+        n = pos->iov->iov_len - pos->off;
+        if ( n > len )
+            n = len;
+        copy_to_ring(ring, (uint8_t *)pos->iov->iov_base + pos->off, n);
+        pos->off += n;
+        len -= n;
+        if ( pos->off == pos->iov->iov_len )
+        {
+            pos->iov++;
+            pos->off = 0;
+        }
+    }
+}
+
+static void iov_pos_skip(struct iov_pos *pos, size_t len)
+{
+    size_t n;
+
+    while ( len )
+    {
+        n = pos->iov->iov_len - pos->off;
+        if ( n > len )
+            n = len;
+        pos->off += n;
+        len -= n;
+        if ( pos->off == pos->iov->iov_len )
+        {
+            pos->iov++;
+            pos->off = 0;
+        }
+    }
+}
+
+/*
+ * Fast path for Tread and Twrite: the fixed size header is built in place,
+ * and the Twrite payload is gathered straight from the caller's buffers
+ * into the ring, advancing <data>. <data> is NULL for Tread.
+ */
+static void send_9p_rw(struct dev_9pfs *dev, struct req *req, uint32_t fid,
+                       uint64_t offset, uint32_t count, struct iov_pos *data)
+{
+    struct p9_rw_header rw;
+    struct ring_9pfs *ring;
 
-    notify_remote_via_evtchn(dev->evtchn);
+    rw.hdr.size = sizeof(rw) + (data ? count : 0);
+    rw.hdr.cmd = req->cmd;
+    rw.hdr.tag = req->id;
+    rw.fid = fid;
+    rw.offset = offset;
+    rw.count = count;
+
+    ring = ring_select(dev, req);
+    down(&ring->ring_out_sem);
+
+    wait_event(ring->waitq, ring_out_free(ring) >= rw.hdr.size);
+
+    copy_to_ring(ring, &rw, sizeof(rw));
+    if ( data )
+        copy_iov_to_ring(ring, data, count);
+
+    send_9p_done(dev, req);
 }
 
 /*
  * Using an opportunistic approach for receiving data: in case multiple
- * requests are outstanding (which is very unlikely), we nevertheless need
- * to consume all data available until we reach the desired request.
+ * requests are outstanding (e.g. for pipelined reads and writes, or with
+ * multiple threads accessing the device), we need to consume all data
+ * available until we reach the desired request.
  * For requests other than the one we are waiting for, we link the complete
  * data to the request via an intermediate buffer. For our own request we can
  * omit that buffer and directly fill the caller provided variables.
@@ -358,6 +613,11 @@ static void send_9p(struct dev_9pfs *dev, struct req *req, const char *fmt, ...)
  *   NULL in the buffer case (in that case the header is located at the start
  *   of the buffer).
  *
+ * rcv_9p_direct(): copy the payload of a successful Rread straight from the
+ *   ring into the buffer registered in req->rbuf. This is done for any
+ *   request having such a buffer, even if it isn't the one we are waiting
+ *   for, so pipelined reads never need an intermediate buffer.
+ *
  * rcv_9p_one(): Checks for an already filled buffer with the correct tag in
  *   it. If none is found, consumes one response. It checks the tag of the
  *   response in order to decide whether to allocate a buffer for putting the
@@ -397,8 +657,9 @@ static void copy_bufs(unsigned char **buf1, unsigned char **buf2,
 static void rcv_9p_copy(struct dev_9pfs *dev, struct req *req,
                         struct p9_header *hdr, const char *fmt, va_list ap)
 {
+    struct ring_9pfs *ring = dev->rings + req->ring;
     struct p9_header *h = hdr ? hdr : (void *)req->data;
-    RING_IDX cons = dev->cons_pvt_in + h->size - sizeof(*h);
+    RING_IDX cons = ring->cons_pvt_in + h->size - sizeof(*h);
     RING_IDX ring_size = XEN_FLEX_RING_SIZE(dev->ring_order);
     unsigned char *buf1, *buf2;
     unsigned int len1, len2;
@@ -415,9 +676,9 @@ static void rcv_9p_copy(struct dev_9pfs *dev, struct req *req,
 
     if ( hdr )
     {
-        buf1 = xen_9pfs_get_ring_ptr(dev->data.in, dev->cons_pvt_in, ring_size);
-        buf2 = xen_9pfs_get_ring_ptr(dev->data.in, 0,  ring_size);
-        len1 = ring_size - xen_9pfs_mask(dev->cons_pvt_in, ring_size);
+        buf1 = xen_9pfs_get_ring_ptr(ring->data.in, ring->cons_pvt_in, ring_size);
+        buf2 = xen_9pfs_get_ring_ptr(ring->data.in, 0,  ring_size);
+        len1 = ring_size - xen_9pfs_mask(ring->cons_pvt_in, ring_size);
         if ( len1 > h->size - sizeof(*h) )
             len1 = h->size - sizeof(*h);
         len2 = h->size - sizeof(*h) - len1;
@@ -443,7 +704,20 @@ static void rcv_9p_copy(struct dev_9pfs *dev, struct req *req,
         req->result = err;
 
         if ( hdr )
-            dev->cons_pvt_in = cons;
+            ring->cons_pvt_in = cons;
+
+        return;
+    }
+
+    if ( h->cmd == P9_CMD_LERROR )
+    {
+        err = EIO;
+        copy_bufs(&buf1, &buf2, &len1, &len2, &err, sizeof(err));
+        printk("9pfs: request %u resulted in error %u\n", req->cmd, err);
+        req->result = err;
+
+        if ( hdr )
+            ring->cons_pvt_in = cons;
 
         return;
     }
@@ -455,7 +729,7 @@ static void rcv_9p_copy(struct dev_9pfs *dev, struct req *req,
                h->cmd, req->cmd + 1);
 
         if ( hdr )
-            dev->cons_pvt_in = cons;
+            ring->cons_pvt_in = cons;
 
         return;
     }
@@ -495,6 +769,18 @@ static void rcv_9p_copy(struct dev_9pfs *dev, struct req *req,
             qval = va_arg(ap, uint8_t *);
             copy_bufs(&buf1, &buf2, &len1, &len2, qval, P9_QID_SIZE);
             break;
+        case 'R':
+            shortval = va_arg(ap, uint16_t *);
+            qval = va_arg(ap, uint8_t *);
+            copy_bufs(&buf1, &buf2, &len1, &len2, shortval, sizeof(*shortval));
+            if ( *shortval > P9_MAXWELEM )
+            {
+                printk("9pfs: illegal response: %u qids\n", *shortval);
+                *shortval = P9_MAXWELEM;
+            }
+            copy_bufs(&buf1, &buf2, &len1, &len2, qval,
+                      *shortval * P9_QID_SIZE);
+            break;
         default:
             printk("rcv_9p: unknown format character %c\n", *f);
             break;
@@ -502,12 +788,43 @@ static void rcv_9p_copy(struct dev_9pfs *dev, struct req *req,
     }
 
     if ( hdr )
-        dev->cons_pvt_in = cons;
+        ring->cons_pvt_in = cons;
+}
+
+static void rcv_9p_direct(struct dev_9pfs *dev, struct req *req,
+                          struct p9_header *hdr)
+{
+    struct ring_9pfs *ring = dev->rings + req->ring;
+    RING_IDX cons = ring->cons_pvt_in + hdr->size - sizeof(*hdr);
+    uint32_t count;
+
+    if ( hdr->size < sizeof(*hdr) + sizeof(count) )
+    {
+        printk("9pfs: illegal response: read reply too short\n");
+        req->rlen = 0;
+        req->result = EIO;
+        ring->cons_pvt_in = cons;
+        return;
+    }
+
+    copy_from_ring(ring, &count, sizeof(count));
+    if ( count > req->rlen ||
+         count > hdr->size - sizeof(*hdr) - sizeof(count) )
+    {
+        printk("9pfs: illegal response: read count %u too large\n", count);
+        count = 0;
+    }
+    copy_from_ring(ring, req->rbuf, count);
+
+    req->rlen = count;
+    req->result = 0;
+    ring->cons_pvt_in = cons;
 }
 
 static bool rcv_9p_one(struct dev_9pfs *dev, struct req *req, const char *fmt,
                        va_list ap)
 {
+    struct ring_9pfs *ring = dev->rings + req->ring;
     struct p9_header hdr;
     struct req *tmp;
 
@@ -520,29 +837,40 @@ static bool rcv_9p_one(struct dev_9pfs *dev, struct req *req, const char *fmt,
         return true;
     }
 
-    wait_event(dev->waitq, ring_in_data(dev) >= sizeof(hdr));
+    /* Response already consumed by rcv_9p_direct(). */
+    if ( !req->inflight )
+        return true;
+
+    wait_event(ring->waitq, ring_in_data(ring) >= sizeof(hdr));
 
-    copy_from_ring(dev, &hdr, sizeof(hdr));
+    copy_from_ring(ring, &hdr, sizeof(hdr));
 
-    wait_event(dev->waitq, ring_in_data(dev) >= hdr.size - sizeof(hdr));
+    wait_event(ring->waitq, ring_in_data(ring) >= hdr.size - sizeof(hdr));
 
     tmp = dev->req + hdr.tag;
-    if ( hdr.tag >= N_REQS || !tmp->inflight )
+    if ( hdr.tag >= N_REQS || !tmp->inflight || tmp->ring != req->ring )
     {
         printk("9pfs: illegal response: %s\n",
                hdr.tag >= N_REQS ? "tag out of bounds" : "request not pending");
-        dev->cons_pvt_in += hdr.size - sizeof(hdr);
+        ring->cons_pvt_in += hdr.size - sizeof(hdr);
 
         return false;
     }
 
     tmp->inflight = false;
 
+    if ( tmp->rbuf && hdr.cmd == tmp->cmd + 1 )
+    {
+        rcv_9p_direct(dev, tmp, &hdr);
+
+        return tmp == req;
+    }
+
     if ( tmp != req )
     {
         tmp->data = malloc(hdr.size);
         memcpy(tmp->data, &hdr, sizeof(hdr));
-        copy_from_ring(dev, tmp->data + sizeof(hdr), hdr.size - sizeof(hdr));
+        copy_from_ring(ring, tmp->data + sizeof(hdr), hdr.size - sizeof(hdr));
 
         return false;
     }
@@ -554,25 +882,26 @@ static bool rcv_9p_one(struct dev_9pfs *dev, struct req *req, const char *fmt,
 
 static void rcv_9p(struct dev_9pfs *dev, struct req *req, const char *fmt, ...)
 {
+    struct ring_9pfs *ring = dev->rings + req->ring;
     va_list ap;
 
     va_start(ap, fmt);
 
-    down(&dev->ring_in_sem);
+    down(&ring->ring_in_sem);
 
     while ( !rcv_9p_one(dev, req, fmt, ap) );
 
     rmb(); /* Read all data before updating ring index. */
-    dev->intf->in_cons = dev->cons_pvt_in;
+    ring->intf->in_cons = ring->cons_pvt_in;
 
-    notify_remote_via_evtchn(dev->evtchn);
+    notify_remote_via_evtchn(ring->evtchn);
 
-    up(&dev->ring_in_sem);
+    up(&ring->ring_in_sem);
 
     va_end(ap);
 }
 
-static int p9_version(struct dev_9pfs *dev)
+static int p9_version(struct dev_9pfs *dev, const char *version)
 {
     unsigned int msize = XEN_FLEX_RING_SIZE(dev->ring_order) / 2;
     struct req *req = get_free_req(dev);
@@ -583,7 +912,7 @@ static int p9_version(struct dev_9pfs *dev)
         return EAGAIN;
 
     req->cmd = P9_CMD_VERSION;
-    send_9p(dev, req, "US", msize, P9_VERSION);
+    send_9p(dev, req, "US", msize, version);
     rcv_9p(dev, req, "US", &dev->msize_max, &verret);
     ret = req->result;
 
@@ -592,7 +921,7 @@ static int p9_version(struct dev_9pfs *dev)
     if ( ret )
         return ret;
 
-    if ( strcmp(verret, P9_VERSION) )
+    if ( strcmp(verret, version) )
         ret = ENOMSG;
     free(verret);
 
@@ -639,41 +968,39 @@ static int p9_clunk(struct dev_9pfs *dev, uint32_t fid)
     return ret;
 }
 
+/*
+ * Walk up to P9_MAXWELEM names in one request. <newfid> is only valid after
+ * success, which requires all names to have been walked.
+ */
 static int p9_walk(struct dev_9pfs *dev, uint32_t fid, uint32_t newfid,
-                   char *name)
+                   unsigned int nwname, char **names)
 {
     struct req *req = get_free_req(dev);
     int ret;
     uint16_t nqid;
-    uint8_t qid[P9_QID_SIZE];
+    uint8_t qid[P9_MAXWELEM * P9_QID_SIZE];
 
     if ( !req )
         return EAGAIN;
 
     req->cmd = P9_CMD_WALK;
-    if ( name[0] )
-    {
-        send_9p(dev, req, "UUuS", fid, newfid, 1, name);
-        rcv_9p(dev, req, "uQ", &nqid, qid);
-    }
-    else
-    {
-        send_9p(dev, req, "UUu", fid, newfid, 0);
-        rcv_9p(dev, req, "u", &nqid);
-    }
+    send_9p(dev, req, "UUA", fid, newfid, nwname, names);
+    rcv_9p(dev, req, "R", &nqid, qid);
 
     ret = req->result;
+    if ( !ret && nqid < nwname )
+        ret = ENOENT;
 
     put_free_req(dev, req);
 
     return ret;
 }
 
-static int p9_open(struct dev_9pfs *dev, uint32_t fid, uint8_t omode)
+static int p9_open(struct dev_9pfs *dev, uint32_t fid, uint8_t omode,
+                   uint8_t *qid)
 {
     struct req *req = get_free_req(dev);
     int ret;
-    uint8_t qid[P9_QID_SIZE];
     uint32_t iounit;
 
     if ( !req )
@@ -691,11 +1018,10 @@ static int p9_open(struct dev_9pfs *dev, uint32_t fid, uint8_t omode)
 }
 
 static int p9_create(struct dev_9pfs *dev, uint32_t fid, char *path,
-                     uint32_t mode, uint8_t omode)
+                     uint32_t mode, uint8_t omode, uint8_t *qid)
 {
     struct req *req = get_free_req(dev);
     int ret;
-    uint8_t qid[P9_QID_SIZE];
     uint32_t iounit;
 
     if ( !req )
@@ -738,250 +1064,1436 @@ static int p9_stat(struct dev_9pfs *dev, uint32_t fid, struct p9_stat *stat)
     return ret;
 }
 
-static int p9_read(struct dev_9pfs *dev, uint32_t fid, uint64_t offset,
-                   uint8_t *data, uint32_t len)
+static int p9_lopen(struct dev_9pfs *dev, uint32_t fid, uint32_t flags,
+                    uint8_t *qid)
 {
     struct req *req = get_free_req(dev);
-    int ret = 0;
-    uint32_t count, count_max;
+    int ret;
+    uint32_t iounit;
 
     if ( !req )
-    {
-        errno = EAGAIN;
-        return -1;
-    }
-    req->cmd = P9_CMD_READ;
-    count_max = dev->msize_max - (sizeof(struct p9_header) + sizeof(uint32_t));
-
-    while ( len )
-    {
-        count = len;
-        if ( count > count_max )
-            count = count_max;
+        return EAGAIN;
 
-        send_9p(dev, req, "ULU", fid, offset, count);
-        rcv_9p(dev, req, "D", &count, data);
+    req->cmd = P9_CMD_LOPEN;
+    send_9p(dev, req, "UU", fid, flags);
+    rcv_9p(dev, req, "QU", qid, &iounit);
 
-        if ( !count )
-            break;
-        if ( req->result )
-        {
-            ret = -1;
-            errno = EIO;
-            printk("9pfs: read got error %d\n", req->result);
-            break;
-        }
-        ret += count;
-        offset += count;
-        data += count;
-        len -= count;
-    }
+    ret = req->result;
 
     put_free_req(dev, req);
 
     return ret;
 }
 
-static int p9_write(struct dev_9pfs *dev, uint32_t fid, uint64_t offset,
-                    const uint8_t *data, uint32_t len)
+static int p9_lcreate(struct dev_9pfs *dev, uint32_t fid, char *name,
+                      uint32_t flags, uint32_t mode, uint8_t *qid)
 {
     struct req *req = get_free_req(dev);
-    int ret = 0;
-    uint32_t count, count_max;
+    int ret;
+    uint32_t iounit;
+    uint32_t gid = 0;
 
     if ( !req )
-    {
-        errno = EAGAIN;
-        return -1;
-    }
-    req->cmd = P9_CMD_WRITE;
-    count_max = dev->msize_max - (sizeof(struct p9_header) + sizeof(uint32_t) +
-                                  sizeof(uint64_t) + sizeof(uint32_t));
+        return EAGAIN;
 
-    while ( len )
-    {
-        count = len;
-        if ( count > count_max )
-            count = count_max;
+    req->cmd = P9_CMD_LCREATE;
+    send_9p(dev, req, "USUUU", fid, name, flags, mode, gid);
+    rcv_9p(dev, req, "QU", qid, &iounit);
 
-        send_9p(dev, req, "ULD", fid, offset, count, data);
-        rcv_9p(dev, req, "U", &count);
-        if ( req->result )
-        {
-            ret = -1;
-            errno = EIO;
-            printk("9pfs: write got error %d\n", req->result);
-            break;
-        }
-        ret += count;
-        offset += count;
-        data += count;
-        len -= count;
-    }
+    ret = req->result;
 
     put_free_req(dev, req);
 
     return ret;
 }
 
-/*
- * Walk from root <steps> levels with the levels listed in <*paths> as a
- * sequence of names. Returns the number of steps not having been able to
- * walk, with <*paths> pointing at the name of the failing walk step.
- * <fid> will be associated with the last successful walk step. Note that
- * the first step should always succeed, as it is an empty walk in order
- * to start at the root (needed for creating new files in root).
- */
-static unsigned int walk_9pfs(struct dev_9pfs *dev, uint32_t fid,
-                              unsigned int steps, char **paths)
+static int p9_getattr(struct dev_9pfs *dev, uint32_t fid, struct p9_attr *attr)
 {
-    uint32_t curr_fid = P9_ROOT_FID;
+    struct req *req = get_free_req(dev);
     int ret;
 
-    while ( steps-- )
-    {
-        ret = p9_walk(dev, curr_fid, fid, *paths);
-        if ( ret )
-            return steps + 1;
-        curr_fid = fid;
-        *paths += strlen(*paths) + 1;
-    }
-
-    return 0;
-}
+    if ( !req )
+        return EAGAIN;
 
-static unsigned int split_path(const char *pathname, char **split_ptr)
-{
-    unsigned int parts = 1;
-    char *p;
+    req->cmd = P9_CMD_GETATTR;
+    send_9p(dev, req, "UL", fid, P9_GETATTR_BASIC);
+    rcv_9p(dev, req, "LQUUULLLLLLLLLLLLLLL", &attr->valid, attr->qid,
+           &attr->mode, &attr->uid, &attr->gid, &attr->nlink, &attr->rdev,
+           &attr->size, &attr->blksize, &attr->blocks, &attr->atime_sec,
+           &attr->atime_nsec, &attr->mtime_sec, &attr->mtime_nsec,
+           &attr->ctime_sec, &attr->ctime_nsec, &attr->btime_sec,
+           &attr->btime_nsec, &attr->gen, &attr->data_version);
 
-    *split_ptr = strdup(pathname);
+    ret = req->result;
 
-    for ( p = strchr(*split_ptr, '/'); p; p = strchr(p + 1, '/') )
-    {
-        *p = 0;
-        parts++;
-    }
+    put_free_req(dev, req);
 
-    return parts;
+    return ret;
 }
 
-static bool path_canonical(const char *pathname)
+static int p9_fsync(struct dev_9pfs *dev, uint32_t fid)
 {
-    unsigned int len = strlen(pathname);
-    const char *c;
+    struct req *req = get_free_req(dev);
+    uint32_t datasync = 0;
+    int ret;
 
-    /* Empty path is allowed. */
-    if ( !len )
-        return true;
+    if ( !req )
+        return EAGAIN;
 
-    /* No trailing '/'. */
-    if ( pathname[len - 1] == '/' )
-        return false;
+    req->cmd = P9_CMD_FSYNC;
+    send_9p(dev, req, "UU", fid, datasync);
+    rcv_9p(dev, req, "");
 
-    /* No self or parent references. */
-    c = pathname;
-    while ( (c = strstr(c, "/.")) != NULL )
-    {
-        if ( c[2] == '.' )
-            c++;
-        if ( c[2] == 0 || c[2] == '/' )
-            return false;
-        c += 2;
-    }
+    ret = req->result;
 
-    /* No "//". */
-    if ( strstr(pathname, "//") )
-        return false;
+    put_free_req(dev, req);
 
-    return true;
+    return ret;
 }
 
-static int connect_9pfs(struct dev_9pfs *dev)
+/* <fid> is clunked by the backend, even if the remove fails. */
+static int p9_remove(struct dev_9pfs *dev, uint32_t fid)
 {
+    struct req *req = get_free_req(dev);
     int ret;
 
-    ret = p9_version(dev);
-    if ( ret )
-        return ret;
+    if ( !req )
+        return EAGAIN;
 
-    return p9_attach(dev);
-}
+    req->cmd = P9_CMD_REMOVE;
+    send_9p(dev, req, "U", fid);
+    rcv_9p(dev, req, "");
+
+    ret = req->result;
+
+    put_free_req(dev, req);
+
+    return ret;
+}
+
+static int p9_unlinkat(struct dev_9pfs *dev, uint32_t dirfid, char *name,
+                       uint32_t flags)
+{
+    struct req *req = get_free_req(dev);
+    int ret;
+
+    if ( !req )
+        return EAGAIN;
+
+    req->cmd = P9_CMD_UNLINKAT;
+    send_9p(dev, req, "USU", dirfid, name, flags);
+    rcv_9p(dev, req, "");
+
+    ret = req->result;
+
+    put_free_req(dev, req);
+
+    return ret;
+}
+
+/*
+ * Read raw directory entries starting at the backend supplied <offset>
+ * cookie. Returns the number of bytes of entry data or -1 (errno set).
+ */
+static int p9_readdir(struct dev_9pfs *dev, uint32_t fid, uint64_t offset,
+                      uint8_t *data, uint32_t count)
+{
+    struct req *req = get_free_req(dev);
+    int ret;
+
+    if ( !req )
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    req->cmd = P9_CMD_READDIR;
+    send_9p(dev, req, "ULU", fid, offset, count);
+    rcv_9p(dev, req, "D", &count, data);
+
+    if ( req->result )
+    {
+        errno = EIO;
+        ret = -1;
+    }
+    else
+        ret = count;
+
+    put_free_req(dev, req);
+
+    return ret;
+}
+
+/*
+ * Large reads and writes are split into multiple requests, which are all
+ * sent before waiting for any response. This allows the backend to process
+ * them concurrently instead of paying a full round trip for each chunk.
+ * The chunk size is chosen such that all pipelined requests or responses
+ * fit into the ring at the same time.
+ */
+static uint32_t rw_count_max(struct dev_9pfs *dev, unsigned int overhead)
+{
+    uint32_t count_max = dev->msize_max;
+
+    if ( count_max > XEN_FLEX_RING_SIZE(dev->ring_order) / P9_RW_PIPELINE )
+        count_max = XEN_FLEX_RING_SIZE(dev->ring_order) / P9_RW_PIPELINE;
+
+    return count_max - (sizeof(struct p9_header) + overhead);
+}
+
+static int p9_read(struct dev_9pfs *dev, uint32_t fid, uint64_t offset,
+                   uint8_t *data, uint32_t len)
+{
+    struct req *req[P9_RW_PIPELINE];
+    uint32_t count[P9_RW_PIPELINE];
+    uint32_t count_max, requested;
+    unsigned int n, i;
+    int ret = 0;
+    int result = 0;
+    bool eof = false;
+
+    count_max = rw_count_max(dev, sizeof(uint32_t));
+
+    while ( len && !eof && !result )
+    {
+        for ( n = 0; n < P9_RW_PIPELINE && len; n++ )
+        {
+            req[n] = get_free_req(dev);
+            if ( !req[n] )
+                break;
+            req[n]->cmd = P9_CMD_READ;
+
+            count[n] = len;
+            if ( count[n] > count_max )
+                count[n] = count_max;
+
+            req[n]->rbuf = data;
+            req[n]->rlen = count[n];
+            send_9p_rw(dev, req[n], fid, offset, count[n], NULL);
+            data += count[n];
+            offset += count[n];
+            len -= count[n];
+        }
+
+        if ( !n )
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        /* Collect all responses, even if we are not interested in them. */
+        for ( i = 0; i < n; i++ )
+        {
+            requested = count[i];
+            rcv_9p(dev, req[i], "");
+            count[i] = req[i]->rlen;
+
+            if ( req[i]->result )
+            {
+                if ( !result )
+                    printk("9pfs: read got error %d\n", req[i]->result);
+                result = req[i]->result;
+            }
+            else if ( !eof )
+            {
+                ret += count[i];
+                eof = count[i] < requested;
+            }
+
+            put_free_req(dev, req[i]);
+        }
+    }
+
+    if ( result )
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    return ret;
+}
+
+/* Write all <len> bytes from <data>, one Twrite at a time. */
+static int p9_write_fill(struct dev_9pfs *dev, uint32_t fid, uint64_t offset,
+                         struct iov_pos *data, uint32_t len)
+{
+    struct iov_pos start;
+    struct req *req;
+    uint32_t count;
+    int ret = 0;
+
+    while ( len )
+    {
+        req = get_free_req(dev);
+        if ( !req )
+            return EAGAIN;
+        req->cmd = P9_CMD_WRITE;
+        start = *data;
+        send_9p_rw(dev, req, fid, offset, len, data);
+        rcv_9p(dev, req, "U", &count);
+
+        ret = req->result;
+        if ( !ret && (!count || count > len) )
+            ret = EIO;
+        put_free_req(dev, req);
+        if ( ret )
+            break;
+
+        if ( count < len )
+        {
+            *data = start;
+            iov_pos_skip(data, count);
+        }
+        offset += count;
+        len -= count;
+    }
+
+    return ret;
+}
+
+/*
+ * A Twrite can take data from several buffers. Up to P9_RW_PIPELINE Twrites
+ * are in flight, so when one of them comes back short the later ones may
+ * already have written data behind it. The gap is then filled, so the file
+ * never holds data past the returned length.
+ */
+static int p9_writev(struct dev_9pfs *dev, uint32_t fid, uint64_t offset,
+                     const struct iovec *iov, int iovcnt)
+{
+    struct iov_pos data = { .iov = iov, .off = 0 };
+    struct iov_pos pos[P9_RW_PIPELINE];
+    struct req *req[P9_RW_PIPELINE];
+    uint32_t count[P9_RW_PIPELINE];
+    uint32_t count_max, requested[P9_RW_PIPELINE];
+    uint64_t off[P9_RW_PIPELINE];
+    unsigned int n, i, last;
+    int ret = 0;
+    int result = 0;
+    bool short_write = false;
+    size_t len = 0;
+
+    for ( i = 0; i < iovcnt; i++ )
+        len += iov[i].iov_len;
+
+    count_max = rw_count_max(dev, sizeof(uint32_t) + sizeof(uint64_t) +
+                                  sizeof(uint32_t));
+
+    while ( len && !short_write && !result )
+    {
+        for ( n = 0; n < P9_RW_PIPELINE && len; n++ )
+        {
+            req[n] = get_free_req(dev);
+            if ( !req[n] )
+                break;
+            req[n]->cmd = P9_CMD_WRITE;
+
+            requested[n] = len;
+            if ( requested[n] > count_max )
+                requested[n] = count_max;
+
+            pos[n] = data;
+            off[n] = offset;
+            send_9p_rw(dev, req[n], fid, offset, requested[n], &data);
+            offset += requested[n];
+            len -= requested[n];
+        }
+
+        if ( !n )
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        /* Collect all responses, <last> is the last chunk with data. */
+        last = 0;
+        for ( i = 0; i < n; i++ )
+        {
+            rcv_9p(dev, req[i], "U", &count[i]);
+
+            if ( req[i]->result )
+            {
+                if ( !result )
+                    printk("9pfs: write got error %d\n", req[i]->result);
+                result = req[i]->result;
+                count[i] = 0;
+            }
+            else if ( count[i] > requested[i] )
+                count[i] = requested[i];
+            if ( count[i] )
+                last = i;
+
+            put_free_req(dev, req[i]);
+        }
+        if ( result )
+            break;
+
+        for ( i = 0; i < last && !result; i++ )
+        {
+            if ( count[i] == requested[i] )
+                continue;
+            iov_pos_skip(pos + i, count[i]);
+            result = p9_write_fill(dev, fid, off[i] + count[i], pos + i,
+                                   requested[i] - count[i]);
+            if ( result )
+                printk("9pfs: write got error %d\n", result);
+        }
+        if ( result )
+            break;
+
+        for ( i = 0; i < last; i++ )
+            ret += requested[i];
+        ret += count[last];
+        short_write = last < n - 1 || count[last] < requested[last];
+    }
+
+    if ( result )
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    return ret;
+}
+
+static int p9_write(struct dev_9pfs *dev, uint32_t fid, uint64_t offset,
+                    const uint8_t *data, uint32_t len)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+
+    return p9_writev(dev, fid, offset, &iov, 1);
+}
+
+/*
+ * The walk cache holds fids of directories which have been walked to
+ * before, so opening files in deep trees doesn't need to walk each path
+ * component again. Entries are dropped in LRU order when the cache is
+ * full, when the directory or one of its parents is removed via this
+ * client, or when a walk starting at them fails.
+ * Changes made by other clients are not seen: a directory removed by
+ * them is only noticed when a walk from it fails, and one renamed by
+ * them stays reachable under its old name until its entry is evicted.
+ */
+static struct walk_cache *walk_cache_lookup(struct dev_9pfs *dev,
+                                            const char *path, unsigned int len)
+{
+    struct walk_cache *entry, *best = NULL;
+    unsigned int i, plen, best_len = 0;
+
+    for ( i = 0; i < WALK_CACHE_SIZE; i++ )
+    {
+        entry = dev->walk_cache + i;
+        if ( !entry->path || entry->stale )
+            continue;
+        plen = strlen(entry->path);
+        if ( plen > len || plen <= best_len ||
+             strncmp(path, entry->path, plen) ||
+             (plen < len && path[plen] != '/') )
+            continue;
+        best = entry;
+        best_len = plen;
+    }
+
+    return best;
+}
+
+static void walk_cache_drop(struct dev_9pfs *dev, struct walk_cache *entry)
+{
+    uint32_t fid = entry->fid;
+
+    free(entry->path);
+    entry->path = NULL;
+    entry->stale = false;
+
+    p9_clunk(dev, fid);
+    put_fid(dev, fid);
+}
+
+/* Returns the new entry with a user reference, or NULL if cache is busy. */
+static struct walk_cache *walk_cache_insert(struct dev_9pfs *dev,
+                                            const char *path, unsigned int len,
+                                            uint32_t fid)
+{
+    struct walk_cache *entry, *victim = NULL;
+    unsigned int i;
+    uint32_t old_fid;
+    char *old_path;
+
+    for ( i = 0; i < WALK_CACHE_SIZE; i++ )
+    {
+        entry = dev->walk_cache + i;
+        if ( !entry->path )
+        {
+            victim = entry;
+            break;
+        }
+        if ( !entry->users && (!victim || entry->lru < victim->lru) )
+            victim = entry;
+    }
+
+    if ( !victim )
+        return NULL;
+
+    /* Take over the entry before blocking in p9_clunk(). */
+    old_path = victim->path;
+    old_fid = victim->fid;
+
+    victim->path = malloc(len + 1);
+    memcpy(victim->path, path, len);
+    victim->path[len] = 0;
+    victim->fid = fid;
+    victim->users = 1;
+    victim->stale = false;
+    victim->lru = ++dev->walk_cache_clock;
+
+    if ( old_path )
+    {
+        free(old_path);
+        p9_clunk(dev, old_fid);
+        put_fid(dev, old_fid);
+    }
+
+    return victim;
+}
+
+/* Drop the entries at or below <path>, which has been removed. */
+static void walk_cache_invalidate(struct dev_9pfs *dev, const char *path)
+{
+    struct walk_cache *entry;
+    unsigned int i, len = strlen(path);
+
+    for ( i = 0; i < WALK_CACHE_SIZE; i++ )
+    {
+        entry = dev->walk_cache + i;
+        if ( !entry->path || strncmp(entry->path, path, len) ||
+             (entry->path[len] && entry->path[len] != '/') )
+            continue;
+        if ( entry->users )
+            entry->stale = true;
+        else
+            walk_cache_drop(dev, entry);
+    }
+}
+
+static void walk_cache_flush(struct dev_9pfs *dev)
+{
+    unsigned int i;
+
+    for ( i = 0; i < WALK_CACHE_SIZE; i++ )
+        if ( dev->walk_cache[i].path )
+            walk_cache_drop(dev, dev->walk_cache + i);
+}
+
+/*
+ * Get a fid for the directory <dir> of length <len> (a path relative to
+ * the mount point, empty for the root). Walks are started at the longest
+ * cached prefix of <dir> and the resulting fid is added to the cache.
+ * The fid must be released via put_dir_fid() with the returned <*entry>.
+ */
+static int get_dir_fid(struct dev_9pfs *dev, const char *dir, unsigned int len,
+                       uint32_t *dirfid, struct walk_cache **entry)
+{
+    struct walk_cache *start;
+    char *names[P9_MAXWELEM];
+    char *tail, *p;
+    unsigned int plen, nwname;
+    uint32_t fid, newfid;
+    bool walked, retried = false;
+    int ret;
+
+    *dirfid = P9_ROOT_FID;
+    *entry = NULL;
+    if ( !len )
+        return 0;
+
+ retry:
+    start = walk_cache_lookup(dev, dir, len);
+    plen = start ? strlen(start->path) : 0;
+    if ( plen == len )
+    {
+        start->users++;
+        start->lru = ++dev->walk_cache_clock;
+        *dirfid = start->fid;
+        *entry = start;
+        return 0;
+    }
+
+    newfid = get_fid(dev);
+    if ( !newfid )
+        return ENFILE;
+
+    if ( start )
+        start->users++;
+    fid = start ? start->fid : P9_ROOT_FID;
+
+    /* Remaining path, starting with a '/'. */
+    tail = malloc(len - plen + 1);
+    memcpy(tail, dir + plen, len - plen);
+    tail[len - plen] = 0;
+
+    ret = 0;
+    walked = false;
+    p = tail;
+    while ( *p && !ret )
+    {
+        for ( nwname = 0; *p && nwname < P9_MAXWELEM; nwname++ )
+        {
+            *p++ = 0;
+            names[nwname] = p;
+            p += strcspn(p, "/");
+        }
+        ret = p9_walk(dev, fid, newfid, nwname, names);
+        if ( !ret )
+            walked = true;
+        fid = newfid;
+    }
+
+    free(tail);
+    if ( start )
+        start->users--;
+
+    if ( ret )
+    {
+        if ( walked )
+            p9_clunk(dev, newfid);
+        put_fid(dev, newfid);
+
+        /* Cached directory might be stale, retry from root once. */
+        if ( start && !start->users && !retried )
+        {
+            walk_cache_drop(dev, start);
+            retried = true;
+            goto retry;
+        }
+
+        return ret;
+    }
+
+    *dirfid = newfid;
+    *entry = walk_cache_insert(dev, dir, len, newfid);
+
+    return 0;
+}
+
+static void put_dir_fid(struct dev_9pfs *dev, uint32_t dirfid,
+                        struct walk_cache *entry)
+{
+    if ( entry )
+    {
+        if ( !--entry->users && entry->stale )
+            walk_cache_drop(dev, entry);
+    }
+    else if ( dirfid != P9_ROOT_FID )
+    {
+        p9_clunk(dev, dirfid);
+        put_fid(dev, dirfid);
+    }
+}
+
+/*
+ * Optional page cache for regular files, keyed by qid path and page index.
+ * Cached pages are dropped when a file is opened with a different qid
+ * version than the one the pages were read with, giving close-to-open
+ * consistency. In write-through mode writes go to the backend and update
+ * cached pages, in write-back mode they only modify the cached pages, which
+ * are written back on fsync(), close() or when the file size is needed.
+ */
+static bool cache_enabled(struct file_9pfs *f9pfs)
+{
+    return f9pfs->regular && f9pfs->dev->cache_mode != P9FRONT_CACHE_NONE;
+}
+
+static bool cache_dirty(struct cache_page *page)
+{
+    return page->dirty_end > page->dirty_start;
+}
+
+static struct cache_page **cache_bucket(struct dev_9pfs *dev, uint64_t path,
+                                        uint64_t index)
+{
+    return dev->cache_hash + (path * 31 + index) % P9_CACHE_HASH;
+}
+
+static struct cache_page *cache_find(struct dev_9pfs *dev, uint64_t path,
+                                     uint64_t index)
+{
+    struct cache_page *page;
+
+    for ( page = *cache_bucket(dev, path, index); page; page = page->next )
+    {
+        if ( page->path == path && page->index == index )
+        {
+            page->lru = ++dev->cache_clock;
+            return page;
+        }
+    }
+
+    return NULL;
+}
+
+static void cache_unhash(struct dev_9pfs *dev, struct cache_page *page)
+{
+    struct cache_page **prev = cache_bucket(dev, page->path, page->index);
+
+    while ( *prev != page )
+        prev = &(*prev)->next;
+    *prev = page->next;
+    page->hashed = false;
+}
+
+/*
+ * Get an empty page for <path>/<index>, reusing the least recently used
+ * clean page if needed. Never blocks, returns NULL if all pages are dirty.
+ */
+static struct cache_page *cache_alloc(struct dev_9pfs *dev, uint64_t path,
+                                      uint32_t version, uint64_t index)
+{
+    struct cache_page *page, *victim = NULL;
+    struct cache_page **bucket;
+    unsigned int i;
+
+    for ( i = 0; i < P9_CACHE_PAGES; i++ )
+    {
+        page = dev->cache + i;
+        if ( !page->hashed )
+        {
+            victim = page;
+            break;
+        }
+        if ( !cache_dirty(page) && (!victim || page->lru < victim->lru) )
+            victim = page;
+    }
+
+    if ( !victim )
+        return NULL;
+
+    if ( !victim->data )
+    {
+        victim->data = (unsigned char *)alloc_page();
+        if ( !victim->data )
+            return NULL;
+    }
+    if ( victim->hashed )
+        cache_unhash(dev, victim);
+
+    victim->path = path;
+    victim->version = version;
+    victim->index = index;
+    victim->valid = 0;
+    victim->dirty_start = 0;
+    victim->dirty_end = 0;
+    victim->lru = ++dev->cache_clock;
+
+    bucket = cache_bucket(dev, path, index);
+    victim->next = *bucket;
+    *bucket = victim;
+    victim->hashed = true;
+
+    return victim;
+}
+
+/*
+ * Write back the dirty part of a page. The data is copied first, as the
+ * page might be modified or reused while blocking in p9_write(). The page
+ * stays dirty unless all of it was written and it wasn't modified meanwhile.
+ */
+static int cache_flush_page(struct dev_9pfs *dev, struct cache_page *page)
+{
+    unsigned int start = page->dirty_start;
+    unsigned int len = page->dirty_end - page->dirty_start;
+    uint64_t path = page->path, index = page->index;
+    uint64_t offset = (index << PAGE_SHIFT) + start;
+    unsigned long seq = page->dirty_seq;
+    uint32_t fid = page->fid;
+    uint8_t *buf;
+    int ret;
+
+    buf = malloc(len);
+    if ( !buf )
+    {
+        printk("9pfs: no memory to write back %u bytes at %llu\n", len,
+               (unsigned long long)offset);
+        return -1;
+    }
+    memcpy(buf, page->data + start, len);
+
+    ret = p9_write(dev, fid, offset, buf, len);
+    free(buf);
+
+    if ( ret != len )
+    {
+        printk("9pfs: write back of %u bytes at %llu failed\n", len,
+               (unsigned long long)offset);
+        return -1;
+    }
+
+    if ( page->hashed && page->path == path && page->index == index &&
+         page->dirty_seq == seq )
+    {
+        page->dirty_start = 0;
+        page->dirty_end = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Write back dirty pages of the file <f9pfs> (all files if NULL). With <own>
+ * only pages modified via the fid of <f9pfs> are written.
+ */
+static int cache_flush(struct dev_9pfs *dev, struct file_9pfs *f9pfs, bool own)
+{
+    struct cache_page *page;
+    unsigned int i;
+    int ret = 0;
+
+    for ( i = 0; i < P9_CACHE_PAGES; i++ )
+    {
+        page = dev->cache + i;
+        if ( !page->hashed || !cache_dirty(page) )
+            continue;
+        if ( f9pfs && (page->path != f9pfs->qpath ||
+                       (own && page->fid != f9pfs->fid)) )
+            continue;
+        if ( cache_flush_page(dev, page) )
+            ret = -1;
+    }
+
+    return ret;
+}
+
+/* Drop dirty pages still referring to <fid>, before it is released. */
+static void cache_drop_fid(struct dev_9pfs *dev, uint32_t fid)
+{
+    struct cache_page *page;
+    unsigned int i;
+
+    for ( i = 0; i < P9_CACHE_PAGES; i++ )
+    {
+        page = dev->cache + i;
+        if ( !page->hashed || !cache_dirty(page) || page->fid != fid )
+            continue;
+        printk("9pfs: dropping %u unwritten bytes at %llu\n",
+               page->dirty_end - page->dirty_start,
+               (unsigned long long)(page->index << PAGE_SHIFT) +
+               page->dirty_start);
+        cache_unhash(dev, page);
+    }
+}
+
+/*
+ * Drop cached pages of <path> not matching <version>. With <truncate> all
+ * pages of <path> are dropped, including dirty ones.
+ */
+static void cache_invalidate(struct dev_9pfs *dev, uint64_t path,
+                             uint32_t version, bool truncate)
+{
+    struct cache_page *page;
+    unsigned int i;
+
+    for ( i = 0; i < P9_CACHE_PAGES; i++ )
+    {
+        page = dev->cache + i;
+        if ( !page->hashed || page->path != path ||
+             (!truncate && page->version == version) )
+            continue;
+        if ( !truncate && cache_dirty(page) )
+        {
+            cache_flush_page(dev, page);
+            if ( !page->hashed || page->path != path ||
+                 page->version == version )
+                continue;
+        }
+        cache_unhash(dev, page);
+    }
+
+    /* Don't let reads in progress insert stale data. */
+    dev->cache_gen++;
+}
+
+static void cache_open(struct file_9pfs *f9pfs, const uint8_t *qid,
+                       bool truncate)
+{
+    memcpy(&f9pfs->qversion, qid + 1, sizeof(f9pfs->qversion));
+    memcpy(&f9pfs->qpath, qid + 5, sizeof(f9pfs->qpath));
+    f9pfs->regular = qid[0] == QID_TYPE_FILE;
+
+    if ( cache_enabled(f9pfs) )
+        cache_invalidate(f9pfs->dev, f9pfs->qpath, f9pfs->qversion, truncate);
+}
+
+/* Store data in a cached page, zeroing any hole behind the old file end. */
+static void cache_page_write(struct cache_page *page, unsigned int poff,
+                             const uint8_t *buf, unsigned int len)
+{
+    if ( poff > page->valid )
+        memset(page->data + page->valid, 0, poff - page->valid);
+    memcpy(page->data + poff, buf, len);
+    if ( page->valid < poff + len )
+        page->valid = poff + len;
+}
+
+/*
+ * The file <path> now extends into page <index>. Cached pages before it which
+ * ended at the old file end are zero filled, as that is how the hole reads.
+ */
+static void cache_extend(struct dev_9pfs *dev, uint64_t path, uint64_t index)
+{
+    struct cache_page *page;
+    unsigned int i;
+
+    for ( i = 0; i < P9_CACHE_PAGES; i++ )
+    {
+        page = dev->cache + i;
+        if ( !page->hashed || page->path != path || page->index >= index ||
+             page->valid == PAGE_SIZE )
+            continue;
+        memset(page->data + page->valid, 0, PAGE_SIZE - page->valid);
+        page->valid = PAGE_SIZE;
+    }
+}
+
+/*
+ * Read up to <nr> (at most P9_CACHE_READAHEAD) uncached pages starting at
+ * page <index> from the backend and add them to the cache. The part of the
+ * data at file position <pos> with up to <len> bytes is copied to <buf>.
+ * Returns the number of bytes copied (0 at end of file) or -1.
+ */
+static int cache_fill(struct file_9pfs *f9pfs, uint64_t index, unsigned int nr,
+                      uint64_t pos, uint8_t *buf, size_t len)
+{
+    struct dev_9pfs *dev = f9pfs->dev;
+    struct cache_page *page;
+    unsigned long gen = dev->cache_gen;
+    unsigned int i, poff, valid, copied;
+    uint8_t *bounce;
+    int ret;
+
+    if ( nr > P9_CACHE_READAHEAD )
+        nr = P9_CACHE_READAHEAD;
+    for ( i = 1; i < nr; i++ )
+        if ( cache_find(dev, f9pfs->qpath, index + i) )
+            break;
+    nr = i;
+
+    bounce = malloc(nr << PAGE_SHIFT);
+    ret = p9_read(dev, f9pfs->fid, index << PAGE_SHIFT, bounce,
+                  nr << PAGE_SHIFT);
+    if ( ret < 0 )
+    {
+        free(bounce);
+        return -1;
+    }
+
+    poff = pos - (index << PAGE_SHIFT);
+    copied = (ret > poff) ? ret - poff : 0;
+    if ( copied > len )
+        copied = len;
+    if ( copied )
+        memcpy(buf, bounce + poff, copied);
+
+    /* Data might be stale if the file was written while reading it. */
+    for ( i = 0; gen == dev->cache_gen && i < nr; i++ )
+    {
+        if ( i && (i << PAGE_SHIFT) >= ret )
+            break;
+        if ( cache_find(dev, f9pfs->qpath, index + i) )
+            continue;
+        page = cache_alloc(dev, f9pfs->qpath, f9pfs->qversion, index + i);
+        if ( !page )
+            break;
+        valid = ret - (i << PAGE_SHIFT);
+        if ( (i << PAGE_SHIFT) > ret )
+            valid = 0;
+        if ( valid > PAGE_SIZE )
+            valid = PAGE_SIZE;
+        cache_page_write(page, 0, bounce + (i << PAGE_SHIFT), valid);
+    }
+
+    free(bounce);
+
+    return copied;
+}
+
+static int cache_read(struct file_9pfs *f9pfs, uint64_t pos, uint8_t *buf,
+                      size_t nbytes)
+{
+    struct dev_9pfs *dev = f9pfs->dev;
+    struct cache_page *page;
+    uint64_t index;
+    unsigned int poff, len;
+    size_t done = 0;
+    int ret;
+
+    while ( done < nbytes )
+    {
+        index = (pos + done) >> PAGE_SHIFT;
+        poff = (pos + done) & ~PAGE_MASK;
+
+        page = cache_find(dev, f9pfs->qpath, index);
+        if ( !page )
+        {
+            ret = cache_fill(f9pfs, index, PFN_UP(poff + nbytes - done),
+                             pos + done, buf + done, nbytes - done);
+            if ( ret < 0 )
+                return done ? done : -1;
+            if ( !ret )
+                break;
+            done += ret;
+            continue;
+        }
+
+        if ( poff >= page->valid )
+            break;
+        len = page->valid - poff;
+        if ( len > nbytes - done )
+            len = nbytes - done;
+        memcpy(buf + done, page->data + poff, len);
+        done += len;
+
+        /* End of file. */
+        if ( page->valid < PAGE_SIZE )
+            break;
+    }
+
+    return done;
+}
+
+static int cache_write(struct file_9pfs *f9pfs, uint64_t pos,
+                       const uint8_t *buf, size_t nbytes)
+{
+    struct dev_9pfs *dev = f9pfs->dev;
+    struct cache_page *page;
+    uint64_t index;
+    unsigned int poff, len;
+    size_t done = 0;
+    bool writeback = dev->cache_mode == P9FRONT_CACHE_WRITEBACK;
+    int ret;
+
+    if ( !writeback )
+    {
+        ret = p9_write(dev, f9pfs->fid, pos, buf, nbytes);
+        if ( ret <= 0 )
+            return ret;
+        nbytes = ret;
+    }
+
+    while ( done < nbytes )
+    {
+        index = (pos + done) >> PAGE_SHIFT;
+        poff = (pos + done) & ~PAGE_MASK;
+        len = PAGE_SIZE - poff;
+        if ( len > nbytes - done )
+            len = nbytes - done;
+
+        page = cache_find(dev, f9pfs->qpath, index);
+
+        if ( writeback && !page )
+        {
+            /* Partial pages need to be read first, or are written through. */
+            if ( len < PAGE_SIZE && !f9pfs->readable )
+                page = NULL;
+            else if ( len < PAGE_SIZE )
+            {
+                if ( cache_fill(f9pfs, index, 1, pos + done, NULL, 0) < 0 )
+                {
+                    if ( !done )
+                        return -1;
+                    goto out;
+                }
+                page = cache_find(dev, f9pfs->qpath, index);
+            }
+            else
+                page = cache_alloc(dev, f9pfs->qpath, f9pfs->qversion, index);
+        }
+
+        if ( writeback && !page )
+        {
+            /* No clean page available or not readable, write through. */
+            ret = p9_write(dev, f9pfs->fid, pos + done, buf + done, len);
+            if ( ret < 0 )
+            {
+                if ( !done )
+                    return -1;
+                goto out;
+            }
+            dev->cache_gen++;
+            done += ret;
+            if ( ret < len )
+                break;
+            continue;
+        }
+
+        if ( page )
+        {
+            cache_page_write(page, poff, buf + done, len);
+            if ( writeback )
+            {
+                if ( !cache_dirty(page) || page->dirty_start > poff )
+                    page->dirty_start = poff;
+                if ( page->dirty_end < poff + len )
+                    page->dirty_end = poff + len;
+                page->dirty_seq++;
+                page->fid = f9pfs->fid;
+            }
+        }
+        done += len;
+    }
+
+    dev->cache_gen++;
+
+ out:
+    if ( done )
+        cache_extend(dev, f9pfs->qpath, pos >> PAGE_SHIFT);
+    return done;
+}
+
+void set_cache_9pfront(void *dev, unsigned int mode)
+{
+    struct dev_9pfs *dev9p = dev;
+    unsigned int i;
+
+    if ( mode != P9FRONT_CACHE_WRITEBACK )
+        cache_flush(dev9p, NULL, false);
+
+    if ( mode == P9FRONT_CACHE_NONE )
+    {
+        for ( i = 0; i < P9_CACHE_PAGES; i++ )
+            if ( dev9p->cache[i].hashed )
+                cache_unhash(dev9p, dev9p->cache + i);
+        dev9p->cache_gen++;
+    }
+
+    dev9p->cache_mode = mode;
+}
+EXPORT_SYMBOL(set_cache_9pfront);
+
+static bool path_canonical(const char *pathname)
+{
+    unsigned int len = strlen(pathname);
+    const char *c;
+
+    /* Empty path is allowed. */
+    if ( !len )
+        return true;
+
+    /* No trailing '/'. */
+    if ( pathname[len - 1] == '/' )
+        return false;
+
+    /* No self or parent references. */
+    c = pathname;
+    while ( (c = strstr(c, "/.")) != NULL )
+    {
+        if ( c[2] == '.' )
+            c++;
+        if ( c[2] == 0 || c[2] == '/' )
+            return false;
+        c += 2;
+    }
+
+    /* No "//". */
+    if ( strstr(pathname, "//") )
+        return false;
+
+    return true;
+}
+
+static int connect_9pfs(struct dev_9pfs *dev)
+{
+    int ret;
+
+    /* Prefer 9P2000.L, fall back to 9P2000.u for older backends. */
+    ret = p9_version(dev, P9_VERSION_L);
+    if ( !ret )
+        dev->dotl = true;
+    else if ( ret == ENOMSG )
+        ret = p9_version(dev, P9_VERSION_U);
+    if ( ret )
+        return ret;
+
+    return p9_attach(dev);
+}
 
 static void intr_9pfs(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
-    struct dev_9pfs *dev = data;
+    struct ring_9pfs *ring = data;
 
-    wake_up(&dev->waitq);
+    wake_up(&ring->waitq);
 }
 
-static int read_9pfs(struct file *file, void *buf, size_t nbytes)
+/* One Tread per buffer, there is no gathering for reads. */
+static int readv_9pfs(struct file *file, const struct iovec *iov, int iovcnt,
+                      off_t *pos)
 {
     struct file_9pfs *f9pfs = file->filedata;
-    int ret;
+    int i, n, ret = 0;
 
-    ret = p9_read(f9pfs->dev, f9pfs->fid, file->offset, buf, nbytes);
-    if ( ret >= 0 )
-        file->offset += ret;
+    for ( i = 0; i < iovcnt; i++ )
+    {
+        if ( cache_enabled(f9pfs) )
+            n = cache_read(f9pfs, *pos, iov[i].iov_base, iov[i].iov_len);
+        else
+            n = p9_read(f9pfs->dev, f9pfs->fid, *pos, iov[i].iov_base,
+                        iov[i].iov_len);
+        if ( n < 0 )
+            return i ? ret : -1;
+        *pos += n;
+        ret += n;
+        if ( n < iov[i].iov_len )
+            break;
+    }
 
     return ret;
 }
 
-static int write_9pfs(struct file *file, const void *buf, size_t nbytes)
+static int read_9pfs(struct file *file, void *buf, size_t nbytes)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = nbytes };
+
+    return readv_9pfs(file, &iov, 1, &file->offset);
+}
+
+static int stat_9pfs(struct dev_9pfs *dev, uint32_t fid, struct stat *buf)
 {
-    struct file_9pfs *f9pfs = file->filedata;
     struct p9_stat stat;
+    struct p9_attr attr;
     int ret;
 
+    if ( dev->dotl )
+    {
+        ret = p9_getattr(dev, fid, &attr);
+        if ( ret )
+            return ret;
+
+        buf->st_mode = attr.mode;
+        buf->st_nlink = attr.nlink;
+        buf->st_atime = attr.atime_sec;
+        buf->st_mtime = attr.mtime_sec;
+        buf->st_ctime = attr.ctime_sec;
+        buf->st_size = attr.size;
+        buf->st_uid = attr.uid;
+        buf->st_gid = attr.gid;
+
+        return 0;
+    }
+
+    ret = p9_stat(dev, fid, &stat);
+    if ( ret )
+        return ret;
+
+    buf->st_mode = (stat.qid[0] == QID_TYPE_DIR) ? S_IFDIR : S_IFREG;
+    buf->st_mode |= stat.mode & 0777;
+    buf->st_atime = stat.atime;
+    buf->st_mtime = stat.mtime;
+    buf->st_ctime = stat.mtime;   /* Best available estimate. */
+    buf->st_size = stat.length;
+    buf->st_uid = stat.n_uid;
+    buf->st_gid = stat.n_gid;
+
+    free_stat(&stat);
+
+    return 0;
+}
+
+/* Without the cache all buffers are gathered into one Twrite. */
+static int writev_9pfs(struct file *file, const struct iovec *iov, int iovcnt,
+                       off_t *pos)
+{
+    struct file_9pfs *f9pfs = file->filedata;
+    struct stat st;
+    int i, n, ret;
+
     if ( f9pfs->append )
     {
-        ret = p9_stat(f9pfs->dev, f9pfs->fid, &stat);
+        if ( cache_enabled(f9pfs) )
+            cache_flush(f9pfs->dev, f9pfs, false);
+        ret = stat_9pfs(f9pfs->dev, f9pfs->fid, &st);
         if ( ret )
         {
             errno = EIO;
             return -1;
         }
-        file->offset = stat.length;
-        free_stat(&stat);
+        *pos = st.st_size;
+    }
+
+    if ( !cache_enabled(f9pfs) )
+    {
+        ret = p9_writev(f9pfs->dev, f9pfs->fid, *pos, iov, iovcnt);
+        if ( ret >= 0 )
+            *pos += ret;
+        return ret;
     }
 
-    ret = p9_write(f9pfs->dev, f9pfs->fid, file->offset, buf, nbytes);
-    if ( ret >= 0 )
-        file->offset += ret;
+    for ( i = 0, ret = 0; i < iovcnt; i++ )
+    {
+        n = cache_write(f9pfs, *pos, iov[i].iov_base, iov[i].iov_len);
+        if ( n < 0 )
+            return i ? ret : -1;
+        *pos += n;
+        ret += n;
+        if ( n < iov[i].iov_len )
+            break;
+    }
 
     return ret;
 }
 
+static int write_9pfs(struct file *file, const void *buf, size_t nbytes)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = nbytes };
+
+    return writev_9pfs(file, &iov, 1, &file->offset);
+}
+
 static int fstat_9pfs(struct file *file, struct stat *buf)
 {
     struct file_9pfs *f9pfs = file->filedata;
-    struct p9_stat stat;
     int ret;
 
-    ret = p9_stat(f9pfs->dev, f9pfs->fid, &stat);
+    /* The size must include data not written back yet. */
+    if ( cache_enabled(f9pfs) )
+        cache_flush(f9pfs->dev, f9pfs, false);
+
+    ret = stat_9pfs(f9pfs->dev, f9pfs->fid, buf);
     if ( ret )
     {
         errno = EIO;
         return -1;
     }
 
-    buf->st_mode = (stat.qid[0] == QID_TYPE_DIR) ? S_IFDIR : S_IFREG;
-    buf->st_mode |= stat.mode & 0777;
-    buf->st_atime = stat.atime;
-    buf->st_mtime = stat.mtime;
-    buf->st_ctime = stat.mtime;   /* Best available estimate. */
-    buf->st_size = stat.length;
-    buf->st_uid = stat.n_uid;
-    buf->st_gid = stat.n_gid;
+    return 0;
+}
 
-    free_stat(&stat);
+static int fsync_9pfs(struct file *file)
+{
+    struct file_9pfs *f9pfs = file->filedata;
+
+    if ( cache_enabled(f9pfs) && cache_flush(f9pfs->dev, f9pfs, true) )
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    /* 9P2000.u has no fsync, writes are done synchronously by the backend. */
+    if ( !f9pfs->dev->dotl )
+        return 0;
+
+    if ( p9_fsync(f9pfs->dev, f9pfs->fid) )
+    {
+        errno = EIO;
+        return -1;
+    }
 
     return 0;
 }
 
+/*
+ * Return the names of the next batch of directory entries in a newly
+ * allocated array. file->offset holds the backend's offset cookie of the
+ * last entry returned. Returns the number of entries, 0 at the end of the
+ * directory, or -1 (errno set).
+ */
+static int readdir_9pfs(struct file *file, char ***names)
+{
+    struct file_9pfs *f9pfs = file->filedata;
+    struct dev_9pfs *dev = f9pfs->dev;
+    uint32_t count = dev->msize_max - sizeof(struct p9_header) -
+                     sizeof(uint32_t);
+    uint8_t *data, *p;
+    uint64_t offset = file->offset;
+    uint16_t len;
+    int ret, n = 0;
+
+    *names = NULL;
+
+    if ( !dev->dotl )
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    data = malloc(count);
+    if ( !data )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    ret = p9_readdir(dev, f9pfs->fid, file->offset, data, count);
+    if ( ret <= 0 )
+    {
+        free(data);
+        return ret;
+    }
+
+    /* Entry: qid[13] offset[8] type[1] name[s] */
+    for ( p = data; p < data + ret; p += P9_QID_SIZE + 11 + len )
+    {
+        if ( p + P9_QID_SIZE + 11 > data + ret )
+            goto err_io;
+        memcpy(&len, p + P9_QID_SIZE + 9, sizeof(len));
+        if ( p + P9_QID_SIZE + 11 + len > data + ret )
+            goto err_io;
+        n++;
+    }
+
+    *names = malloc(n * sizeof(**names));
+    if ( !*names )
+        goto err_nomem;
+    n = 0;
+    for ( p = data; p < data + ret; p += P9_QID_SIZE + 11 + len )
+    {
+        if ( p + P9_QID_SIZE + 11 > data + ret )
+            goto err_io;
+        memcpy(&offset, p + P9_QID_SIZE, sizeof(offset));
+        memcpy(&len, p + P9_QID_SIZE + 9, sizeof(len));
+        if ( p + P9_QID_SIZE + 11 + len > data + ret )
+            goto err_io;
+        (*names)[n] = malloc(len + 1);
+        if ( !(*names)[n] )
+            goto err_nomem;
+        memcpy((*names)[n], p + P9_QID_SIZE + 11, len);
+        (*names)[n][len] = 0;
+        n++;
+    }
+    file->offset = offset;
+
+    free(data);
+
+    return n;
+
+ err_io:
+    errno = EIO;
+    goto err;
+ err_nomem:
+    errno = ENOMEM;
+ err:
+    if ( *names )
+    {
+        while ( n-- )
+            free((*names)[n]);
+        free(*names);
+        *names = NULL;
+    }
+    free(data);
+
+    return -1;
+}
+
 static int close_9pfs(struct file *file)
 {
     struct file_9pfs *f9pfs = file->filedata;
+    int ret = 0;
+
+    if ( cache_enabled(f9pfs) )
+    {
+        if ( cache_flush(f9pfs->dev, f9pfs, true) )
+        {
+            errno = EIO;
+            ret = -1;
+        }
+        /* The fid can be reused, pages failing write back are lost. */
+        cache_drop_fid(f9pfs->dev, f9pfs->fid);
+    }
 
     if ( f9pfs->fid != P9_ROOT_FID )
     {
@@ -991,19 +2503,21 @@ static int close_9pfs(struct file *file)
 
     free(f9pfs);
 
-    return 0;
+    return ret;
 }
 
 static int open_9pfs(struct mount_point *mnt, const char *pathname, int flags,
                      mode_t mode)
 {
     int fd;
-    char *path = NULL;
-    char *p;
+    char *name;
     struct file *file;
     struct file_9pfs *f9pfs;
-    uint16_t nwalk;
+    struct walk_cache *entry;
+    uint32_t dirfid;
+    uint8_t qid[P9_QID_SIZE];
     uint8_t omode;
+    uint32_t lflags;
     int ret;
 
     if ( !path_canonical(pathname) )
@@ -1021,12 +2535,15 @@ static int open_9pfs(struct mount_point *mnt, const char *pathname, int flags,
     {
     case O_RDONLY:
         omode = P9_OREAD;
+        lflags = P9_DOTL_RDONLY;
         break;
     case O_WRONLY:
         omode = P9_OWRITE;
+        lflags = P9_DOTL_WRONLY;
         break;
     case O_RDWR:
         omode = P9_ORDWR;
+        lflags = P9_DOTL_RDWR;
         break;
     default:
         ret = EINVAL;
@@ -1034,63 +2551,199 @@ static int open_9pfs(struct mount_point *mnt, const char *pathname, int flags,
     }
 
     if ( flags & O_TRUNC )
+    {
         omode |= P9_OTRUNC;
+        lflags |= P9_DOTL_TRUNC;
+    }
     f9pfs->append = flags & O_APPEND;
+    f9pfs->readable = (flags & O_ACCMODE) != O_WRONLY;
 
-    nwalk = split_path(pathname, &path);
+    name = strrchr(pathname, '/');
+    ret = get_dir_fid(mnt->dev, pathname, name ? name - pathname : 0,
+                      &dirfid, &entry);
+    if ( ret )
+        goto err;
+    name = name ? name + 1 : (char *)pathname;
 
     f9pfs->fid = get_fid(mnt->dev);
     if ( !f9pfs->fid )
     {
+        put_dir_fid(mnt->dev, dirfid, entry);
         ret = ENFILE;
         goto err;
     }
-    p = path;
-    nwalk = walk_9pfs(mnt->dev, f9pfs->fid, nwalk, &p);
-    if ( nwalk )
+
+    ret = p9_walk(mnt->dev, dirfid, f9pfs->fid, name[0] ? 1 : 0, &name);
+    if ( ret )
     {
-        if ( nwalk > 1 || !(flags & O_CREAT) )
+        if ( !(flags & O_CREAT) ||
+             p9_walk(mnt->dev, dirfid, f9pfs->fid, 0, NULL) )
         {
+            put_dir_fid(mnt->dev, dirfid, entry);
+            put_fid(mnt->dev, f9pfs->fid);
+            f9pfs->fid = P9_ROOT_FID;
             ret = ENOENT;
             goto err;
         }
 
-        ret = p9_create(mnt->dev, f9pfs->fid, p, mode, omode);
-        if ( ret )
-            goto err;
-        goto out;
+        if ( f9pfs->dev->dotl )
+            ret = p9_lcreate(mnt->dev, f9pfs->fid, name,
+                             lflags | P9_DOTL_CREATE, mode, qid);
+        else
+            ret = p9_create(mnt->dev, f9pfs->fid, name, mode, omode, qid);
+        flags |= O_TRUNC;   /* Stale cache contents must be dropped. */
     }
+    else if ( f9pfs->dev->dotl )
+        ret = p9_lopen(mnt->dev, f9pfs->fid, lflags, qid);
+    else
+        ret = p9_open(mnt->dev, f9pfs->fid, omode, qid);
 
-    ret = p9_open(mnt->dev, f9pfs->fid, omode);
+    put_dir_fid(mnt->dev, dirfid, entry);
     if ( ret )
         goto err;
 
- out:
-    free(path);
+    cache_open(f9pfs, qid, flags & O_TRUNC);
 
     return fd;
 
  err:
-    free(path);
     close(fd);
     errno = ret;
 
     return -1;
 }
 
-static void free_9pfront(struct dev_9pfs *dev)
+static int remove_9pfs(struct mount_point *mnt, const char *pathname)
+{
+    struct dev_9pfs *dev = mnt->dev;
+    struct walk_cache *entry;
+    uint32_t dirfid, fid;
+    char *name;
+    int ret;
+
+    if ( !path_canonical(pathname) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The mount point itself can't be removed. */
+    name = strrchr(pathname, '/');
+    if ( !name )
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    ret = get_dir_fid(dev, pathname, name - pathname, &dirfid, &entry);
+    if ( ret )
+    {
+        errno = ret;
+        return -1;
+    }
+    name++;
+
+    if ( dev->dotl )
+    {
+        /* remove() doesn't know the file type, try a directory next. */
+        ret = p9_unlinkat(dev, dirfid, name, 0);
+        if ( ret == EISDIR )
+            ret = p9_unlinkat(dev, dirfid, name, P9_DOTL_AT_REMOVEDIR);
+    }
+    else
+    {
+        fid = get_fid(dev);
+        if ( !fid )
+            ret = ENFILE;
+        else
+        {
+            ret = p9_walk(dev, dirfid, fid, 1, &name);
+            if ( !ret )
+                ret = p9_remove(dev, fid);
+            put_fid(dev, fid);
+        }
+    }
+
+    put_dir_fid(dev, dirfid, entry);
+    if ( ret )
+    {
+        errno = ret;
+        return -1;
+    }
+
+    walk_cache_invalidate(dev, pathname);
+
+    return 0;
+}
+
+static void free_ring(struct ring_9pfs *ring)
+{
+    unsigned int i;
+
+    if ( !ring->intf )
+        return;
+
+    if ( ring->data.in )
+    {
+        /* Not the backend writable intf->ring_order and intf->ref[]. */
+        for ( i = 0; i < (1 << ring->dev->ring_order); i++ )
+            gnttab_end_access(ring->data_ref[i]);
+        free_pages(ring->data.in, ring->dev->ring_order);
+    }
+    if ( ring->evtchn )
+        unbind_evtchn(ring->evtchn);
+    gnttab_end_access(ring->ring_ref);
+    free_page(ring->intf);
+}
+
+/*
+ * Set up a ring with the device's ring order. If memory is short for the
+ * first ring, the ring order is lowered, which then applies to all rings.
+ */
+static char *init_ring(struct dev_9pfs *dev, struct ring_9pfs *ring,
+                       bool first)
 {
     unsigned int i;
+    void *addr;
+
+    ring->dev = dev;
+    init_waitqueue_head(&ring->waitq);
+    init_SEMAPHORE(&ring->ring_out_sem, 1);
+    init_SEMAPHORE(&ring->ring_in_sem, 1);
 
-    if ( dev->data.in && dev->intf )
+    ring->ring_ref = gnttab_alloc_and_grant((void **)&ring->intf);
+    memset(ring->intf, 0, PAGE_SIZE);
+    if ( evtchn_alloc_unbound(dev->dom, intr_9pfs, ring, &ring->evtchn) )
+        return "no event channel";
+
+    while ( !(ring->data.in = (void *)alloc_pages(dev->ring_order)) )
+    {
+        if ( !first || !dev->ring_order )
+            return "no memory for ring";
+        dev->ring_order--;
+    }
+    ring->intf->ring_order = dev->ring_order;
+    ring->data.out = ring->data.in + XEN_FLEX_RING_SIZE(dev->ring_order);
+    for ( i = 0; i < (1 << dev->ring_order); i++ )
     {
-        for ( i = 0; i < (1 << dev->ring_order); i++ )
-            gnttab_end_access(dev->intf->ref[i]);
-        free_pages(dev->data.in, dev->ring_order);
+        addr = ring->data.in + i * PAGE_SIZE;
+        ring->data_ref[i] = gnttab_grant_access(dev->dom, virt_to_mfn(addr),
+                                                0);
+        ring->intf->ref[i] = ring->data_ref[i];
     }
-    unbind_evtchn(dev->evtchn);
-    gnttab_end_access(dev->ring_ref);
-    free_page(dev->intf);
+
+    return NULL;
+}
+
+static void free_9pfront(struct dev_9pfs *dev)
+{
+    unsigned int i;
+
+    for ( i = 0; i < MAX_9PFS_RINGS; i++ )
+        free_ring(dev->rings + i);
+    for ( i = 0; i < P9_CACHE_PAGES; i++ )
+        if ( dev->cache[i].data )
+            free_page(dev->cache[i].data);
     free(dev->backend);
     free(dev->tag);
     free(dev);
@@ -1101,12 +2754,11 @@ void *init_9pfront(unsigned int id, const char *mnt)
     struct dev_9pfs *dev;
     char *msg;
     char *reason = "";
-    xenbus_transaction_t xbt;
-    int retry = 1;
+    struct xenbus_batch batch;
     char bepath[64] = { 0 };
     XenbusState state;
     unsigned int i;
-    void *addr;
+    char path[24];
     char *version;
     char *v;
 
@@ -1115,10 +2767,8 @@ void *init_9pfront(unsigned int id, const char *mnt)
     memset(dev, 0, sizeof(*dev));
     snprintf(dev->nodename, sizeof(dev->nodename), "device/9pfs/%u", id);
     dev->id = id;
-    init_waitqueue_head(&dev->waitq);
-    init_SEMAPHORE(&dev->ring_out_sem, 1);
-    init_SEMAPHORE(&dev->ring_in_sem, 1);
-    dev->fid_mask = ~0ULL;
+    memset(dev->fid_map, 0xff, sizeof(dev->fid_map));
+    dev->fid_map[0] &= ~1UL;             /* P9_ROOT_FID */
 
     for ( i = 0; i < N_REQS; i++ )
     {
@@ -1152,8 +2802,18 @@ void *init_9pfront(unsigned int id, const char *mnt)
                                &dev->ring_order);
     if ( msg )
         goto err;
-    if ( dev->ring_order > DEFAULT_9PFS_RING_ORDER )
-        dev->ring_order = DEFAULT_9PFS_RING_ORDER;
+    if ( dev->ring_order > MAX_9PFS_RING_ORDER )
+        dev->ring_order = MAX_9PFS_RING_ORDER;
+
+    /* "max-rings" is optional, a single ring is always supported. */
+    msg = xenbus_read_unsigned(XBT_NIL, dev->backend, "max-rings",
+                               &dev->num_rings);
+    if ( msg || !dev->num_rings )
+        dev->num_rings = 1;
+    free(msg);
+    msg = NULL;
+    if ( dev->num_rings > MAX_9PFS_RINGS )
+        dev->num_rings = MAX_9PFS_RINGS;
 
     msg = xenbus_read_string(XBT_NIL, dev->backend, "versions", &version);
     if ( msg )
@@ -1179,54 +2839,40 @@ void *init_9pfront(unsigned int id, const char *mnt)
         goto err;
     }
 
-    dev->ring_ref = gnttab_alloc_and_grant((void **)&dev->intf);
-    memset(dev->intf, 0, PAGE_SIZE);
-    if ( evtchn_alloc_unbound(dev->dom, intr_9pfs, dev, &dev->evtchn) )
-    {
-        reason = "no event channel";
-        goto err;
-    }
-    dev->intf->ring_order = dev->ring_order;
-    dev->data.in = (void *)alloc_pages(dev->ring_order);
-    dev->data.out = dev->data.in + XEN_FLEX_RING_SIZE(dev->ring_order);
-    for ( i = 0; i < (1 << dev->ring_order); i++ )
-    {
-        addr = dev->data.in + i * PAGE_SIZE;
-        dev->intf->ref[i] = gnttab_grant_access(dev->dom, virt_to_mfn(addr), 0);
-    }
-
-    while ( retry )
+    for ( i = 0; i < dev->num_rings; i++ )
     {
-        msg = xenbus_transaction_start(&xbt);
-        if ( msg )
+        reason = init_ring(dev, dev->rings + i, !i);
+        if ( reason )
         {
-            free(msg);
-            msg = NULL;
-            reason = "starting transaction";
-            goto err;
+            /* Additional rings are optional. */
+            if ( !i )
+                goto err;
+            free_ring(dev->rings + i);
+            memset(dev->rings + i, 0, sizeof(dev->rings[i]));
+            dev->num_rings = i;
+            break;
         }
+    }
 
-        msg = xenbus_printf(xbt, dev->nodename, "version", "%u", 1);
-        if ( msg )
-            goto err_tr;
-        msg = xenbus_printf(xbt, dev->nodename, "num-rings", "%u", 1);
-        if ( msg )
-            goto err_tr;
-        msg = xenbus_printf(xbt, dev->nodename, "ring-ref0", "%u",
-                            dev->ring_ref);
-        if ( msg )
-            goto err_tr;
-        msg = xenbus_printf(xbt, dev->nodename, "event-channel-0", "%u",
-                            dev->evtchn);
-        if ( msg )
-            goto err_tr;
-        msg = xenbus_printf(xbt, dev->nodename, "state", "%u",
-                            XenbusStateInitialised);
-        if ( msg )
-            goto err_tr;
-
-        free(xenbus_transaction_end(xbt, 0, &retry));
+    xenbus_batch_init(&batch);
+    xenbus_batch_printf(&batch, dev->nodename, "version", "%u", 1);
+    xenbus_batch_printf(&batch, dev->nodename, "num-rings", "%u",
+                        dev->num_rings);
+    for ( i = 0; i < dev->num_rings; i++ )
+    {
+        snprintf(path, sizeof(path), "ring-ref%u", i);
+        xenbus_batch_printf(&batch, dev->nodename, path, "%u",
+                            dev->rings[i].ring_ref);
+        snprintf(path, sizeof(path), "event-channel-%u", i);
+        xenbus_batch_printf(&batch, dev->nodename, path, "%u",
+                            dev->rings[i].evtchn);
     }
+    xenbus_batch_printf(&batch, dev->nodename, "state", "%u",
+                        XenbusStateInitialised);
+    msg = xenbus_batch_commit(&batch);
+    xenbus_batch_free(&batch);
+    if ( msg )
+        goto err;
 
     state = xenbus_read_integer(bepath);
     while ( msg == NULL && state < XenbusStateConnected )
@@ -1242,7 +2888,8 @@ void *init_9pfront(unsigned int id, const char *mnt)
     if ( msg )
         goto err;
 
-    unmask_evtchn(dev->evtchn);
+    for ( i = 0; i < dev->num_rings; i++ )
+        unmask_evtchn(dev->rings[i].evtchn);
 
     if ( connect_9pfs(dev) )
     {
@@ -1256,12 +2903,10 @@ void *init_9pfront(unsigned int id, const char *mnt)
         reason = "mount failed";
         goto err;
     }
+    mount_set_remove(dev->mnt, remove_9pfs);
 
     return dev;
 
- err_tr:
-    free(xenbus_transaction_end(xbt, 1, &retry));
-
  err:
     if ( bepath[0] )
         free(xenbus_unwatch_path_token(XBT_NIL, bepath, bepath));
@@ -1285,6 +2930,8 @@ void shutdown_9pfront(void *dev)
     char *reason = "";
 
     umount(dev9p->mnt);
+    set_cache_9pfront(dev9p, P9FRONT_CACHE_NONE);
+    walk_cache_flush(dev9p);
     snprintf(bepath, sizeof(bepath), "%s/state", dev9p->backend);
 
     msg = xenbus_printf(XBT_NIL, dev9p->nodename, "state", "%u",
@@ -1324,8 +2971,12 @@ static const struct file_ops ops_9pfs = {
     .name = "9pfs",
     .read = read_9pfs,
     .write = write_9pfs,
+    .readv = readv_9pfs,
+    .writev = writev_9pfs,
     .close = close_9pfs,
     .fstat = fstat_9pfs,
+    .fsync = fsync_9pfs,
+    .readdir = readdir_9pfs,
     .lseek = lseek_default,
 };
 
@@ -205,6 +205,9 @@ CONFIG-n += CONFIG_LIBXENTOOLCORE
 CONFIG-n += CONFIG_LIBXENTOOLLOG
 CONFIG-n += CONFIG_LIBXENMANAGE
 CONFIG-n += CONFIG_KEXEC
+CONFIG-n += CONFIG_TRACE
+CONFIG-n += CONFIG_LWIP_THROUGHPUT
+CONFIG-n += CONFIG_LWIP_RX_THREAD
 # Setting CONFIG_USE_XEN_CONSOLE copies all print output to the Xen emergency
 # console apart of standard dom0 handled console.
 CONFIG-n += CONFIG_USE_XEN_CONSOLE
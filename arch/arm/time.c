@@ -72,13 +72,23 @@ uint64_t monotonic_clock(void)
     return ticks_to_ns(read_virtual_count() - cntvct_at_init);
 }
 
+/* Reading the virtual counter is cheap, there is no coarser variant. */
+uint64_t monotonic_clock_coarse(void)
+{
+    return monotonic_clock();
+}
+
+/* wallclock_base(): returns wall clock time in ns at system time 0. */
+uint64_t wallclock_base(void)
+{
+    return shadow_ts.tv_sec * 1000000000ULL + shadow_ts.tv_nsec;
+}
+
 int gettimeofday(struct timeval *tv, void *tz)
 {
-    uint64_t nsec = monotonic_clock();
-    nsec += shadow_ts.tv_nsec;
+    uint64_t nsec = wallclock_base() + monotonic_clock();
 
-    tv->tv_sec = shadow_ts.tv_sec;
-    tv->tv_sec += NSEC_TO_SEC(nsec);
+    tv->tv_sec = NSEC_TO_SEC(nsec);
     tv->tv_usec = NSEC_TO_USEC(nsec % 1000000000UL);
 
     return 0;
@@ -629,7 +629,7 @@ unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
                 pgt = get_pgt(addr);
             if ( pgt )
             {
-                if ( *pgt & _PAGE_PRESENT )
+                if ( *pgt )
                     break;
                 pgt++;
             }
@@ -822,6 +822,28 @@ int unmap_frames(unsigned long va, unsigned long num_frames)
 }
 EXPORT_SYMBOL(unmap_frames);
 
+/*
+ * Replace the mapping of the single page at va, whose page table must
+ * exist already, and flush the old TLB entry.
+ */
+int remap_frame(unsigned long va, unsigned long mfn, unsigned long prot)
+{
+#ifdef CONFIG_PARAVIRT
+    return HYPERVISOR_update_va_mapping(va, __pte((mfn << PAGE_SHIFT) | prot),
+                                        UVMF_INVLPG);
+#else
+    pgentry_t *pgt = get_pgt(va);
+
+    if ( !pgt )
+        return -EINVAL;
+    ASSERT(!(*pgt & _PAGE_PSE));
+    *pgt = (mfn << PAGE_SHIFT) | prot;
+    invlpg(va);
+    return 0;
+#endif
+}
+EXPORT_SYMBOL(remap_frame);
+
 #ifdef CONFIG_PARAVIRT
 void p2m_chk_pfn(unsigned long pfn)
 {
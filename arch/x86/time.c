@@ -38,24 +38,12 @@
 #include <mini-os/events.h>
 #include <mini-os/time.h>
 #include <mini-os/lib.h>
+#include <xen/vcpu.h>
 
 /************************************************************************
  * Time functions
  *************************************************************************/
 
-/* These are peridically updated in shared_info, and then copied here. */
-static struct timespec shadow_ts;
-static uint32_t shadow_ts_version;
-
-static struct vcpu_time_info shadow;
-
-static inline int wc_values_up_to_date(void)
-{
-    shared_info_t *s = HYPERVISOR_shared_info;
-
-    return shadow_ts_version == s->wc_version;
-}
-
 /*
  * Scale a 64-bit delta by scaling and multiplying by a 32-bit fraction,
  * yielding a 64-bit result.
@@ -92,14 +80,16 @@ static inline uint64_t scale_delta(uint64_t delta, uint32_t mul_frac, int shift)
     return product;
 }
 
-static unsigned long get_nsec_offset(void)
+/*
+ * The time values are read directly from the vcpu_time_info of the current
+ * cpu in shared_info. Xen updates them using the version field as a
+ * sequence counter (odd while an update is in progress), so readers only
+ * need to retry in case they raced with an update. No locking and no
+ * shadow copy, which would need protection of its own, are required.
+ */
+static inline struct vcpu_time_info *vcpu_time(void)
 {
-    uint64_t now, delta;
-
-    rdtscll(now);
-    delta = now - shadow.tsc_timestamp;
-
-    return scale_delta(delta, shadow.tsc_to_system_mul, shadow.tsc_shift);
+    return &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()].time;
 }
 
 /*
@@ -109,48 +99,66 @@ static unsigned long get_nsec_offset(void)
  */
 uint64_t monotonic_clock(void)
 {
-    struct vcpu_time_info *src = &HYPERVISOR_shared_info->vcpu_info[0].time;
+    struct vcpu_time_info *src = vcpu_time();
+    uint32_t version;
+    uint64_t now, time;
 
-    if ( shadow.version != src->version )
-    {
-        do {
-            shadow.version = src->version;
-            rmb();
-            shadow.tsc_timestamp     = src->tsc_timestamp;
-            shadow.system_time       = src->system_time;
-            shadow.tsc_to_system_mul = src->tsc_to_system_mul;
-            shadow.tsc_shift         = src->tsc_shift;
-            rmb();
-        } while ( (src->version & 1) || (shadow.version != src->version) );
-    }
+    do {
+        version = src->version;
+        rmb();
+        rdtscll(now);
+        time = src->system_time +
+               scale_delta(now - src->tsc_timestamp, src->tsc_to_system_mul,
+                           src->tsc_shift);
+        rmb();
+    } while ( (version & 1) || (version != src->version) );
 
-    return shadow.system_time + get_nsec_offset();
+    return time;
 }
 
-static void update_wallclock(void)
+/*
+ * monotonic_clock_coarse(): like monotonic_clock(), but without reading
+ *        the TSC. Returns the system time as of the last update done by
+ *        the hypervisor, so it may lag behind by up to a few seconds.
+ */
+uint64_t monotonic_clock_coarse(void)
 {
-    shared_info_t *s = HYPERVISOR_shared_info;
+    struct vcpu_time_info *src = vcpu_time();
+    uint32_t version;
+    uint64_t time;
 
     do {
-        shadow_ts_version = s->wc_version;
+        version = src->version;
         rmb();
-        shadow_ts.tv_sec  = s->wc_sec;
-        shadow_ts.tv_nsec = s->wc_nsec;
+        time = src->system_time;
         rmb();
-    } while ( (s->wc_version & 1) | (shadow_ts_version ^ s->wc_version) );
+    } while ( (version & 1) || (version != src->version) );
+
+    return time;
 }
 
-int gettimeofday(struct timeval *tv, void *tz)
+/* wallclock_base(): returns wall clock time in ns at system time 0. */
+uint64_t wallclock_base(void)
 {
-    uint64_t nsec = monotonic_clock();
+    shared_info_t *s = HYPERVISOR_shared_info;
+    uint32_t version;
+    uint64_t base;
+
+    do {
+        version = s->wc_version;
+        rmb();
+        base = s->wc_sec * 1000000000ULL + s->wc_nsec;
+        rmb();
+    } while ( (version & 1) || (version != s->wc_version) );
 
-    if ( !wc_values_up_to_date() )
-        update_wallclock();
+    return base;
+}
 
-    nsec += shadow_ts.tv_nsec;
+int gettimeofday(struct timeval *tv, void *tz)
+{
+    uint64_t nsec = wallclock_base() + monotonic_clock();
 
-    tv->tv_sec = shadow_ts.tv_sec;
-    tv->tv_sec += NSEC_TO_SEC(nsec);
+    tv->tv_sec = NSEC_TO_SEC(nsec);
     tv->tv_usec = NSEC_TO_USEC(nsec % 1000000000UL);
 
     return 0;
@@ -174,15 +182,22 @@ void block_domain(s_time_t until)
     }
 }
 
+/*
+ * The timer is purely one-shot: it is armed by block_domain() for the next
+ * deadline only, and its sole purpose is to wake us up. There is nothing to
+ * do here, in particular no re-arming.
+ */
 static void timer_handler(evtchn_port_t ev, struct pt_regs *regs, void *ign)
 {
-    HYPERVISOR_set_timer_op(monotonic_clock() + MILLISECS(1));
 }
 
 static evtchn_port_t port;
 
 void init_time(void)
 {
+    /* Xen starts vcpus with a periodic tick, we don't need it. */
+    HYPERVISOR_vcpu_op(VCPUOP_stop_periodic_timer, 0, NULL);
+
     port = bind_virq(VIRQ_TIMER, &timer_handler, NULL);
     unmask_evtchn(port);
 }
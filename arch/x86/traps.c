@@ -212,6 +212,11 @@ void do_page_fault(struct pt_regs *regs, unsigned long error_code)
     if ((error_code & TRAP_PF_WRITE) && handle_cow(addr))
 	return;
 
+#ifdef HAVE_LIBC
+    if (mmap_fault(regs, addr, error_code & TRAP_PF_WRITE))
+	return;
+#endif
+
     /* If we are already handling a page fault, and got another one
        that means we faulted in pagetable walk. Continuing here would cause
        a recursive fault */       
@@ -15,6 +15,8 @@
 #include <time.h>
 #include <mini-os/blkfront.h>
 #include <mini-os/lib.h>
+#include <mini-os/semaphore.h>
+#include <mini-os/trace.h>
 #include <fcntl.h>
 
 /* Note: we generally don't need to disable IRQs since we hardly do anything in
@@ -47,21 +49,29 @@ struct blkfront_dev {
     struct blkfront_info info;
 
     xenbus_event_queue events;
+    /* Woken on responses, so waiters only see their own device. */
+    struct wait_queue_head waitq;
 
 #ifdef HAVE_LIBC
     int fd;
+    /* Serialises read() and write(), which use the file offset. */
+    struct semaphore offset_sem;
+    /* Serialises writes, so that the read-modify-write of a partial
+     * block cannot write stale data over another write to that block. */
+    struct semaphore rmw_sem;
 #endif
 };
 
 void blkfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
-#ifdef HAVE_LIBC
     struct blkfront_dev *dev = data;
+#ifdef HAVE_LIBC
     struct file *file = get_file_from_fd(dev->fd);
 
     if ( file )
-        file->read = true;
+        file_set_events(file, POLLIN);
 #endif
+    wake_up(&dev->waitq);
     wake_up(&blkfront_queue);
 }
 
@@ -82,11 +92,9 @@ static void free_blkfront(struct blkfront_dev *dev)
 
 struct blkfront_dev *init_blkfront(char *_nodename, struct blkfront_info *info)
 {
-    xenbus_transaction_t xbt;
+    struct xenbus_batch batch;
     char* err;
-    char* message=NULL;
     struct blkif_sring *s;
-    int retry=0;
     char* msg = NULL;
     char* c;
     char* nodename = _nodename ? _nodename : "device/vbd/768";
@@ -102,7 +110,10 @@ struct blkfront_dev *init_blkfront(char *_nodename, struct blkfront_info *info)
     dev->nodename = strdup(nodename);
 #ifdef HAVE_LIBC
     dev->fd = -1;
+    init_MUTEX(&dev->offset_sem);
+    init_MUTEX(&dev->rmw_sem);
 #endif
+    init_waitqueue_head(&dev->waitq);
 
     snprintf(path, sizeof(path), "%s/backend-id", nodename);
     dev->dom = xenbus_read_integer(path); 
@@ -119,57 +130,20 @@ struct blkfront_dev *init_blkfront(char *_nodename, struct blkfront_info *info)
 
     dev->events = NULL;
 
-again:
-    err = xenbus_transaction_start(&xbt);
-    if (err) {
-        printk("starting transaction\n");
-        free(err);
-    }
-
-    err = xenbus_printf(xbt, nodename, "ring-ref","%u",
-                dev->ring_ref);
-    if (err) {
-        message = "writing ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename,
-                "event-channel", "%u", dev->evtchn);
-    if (err) {
-        message = "writing event-channel";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename,
-                "protocol", "%s", XEN_IO_PROTO_ABI_NATIVE);
-    if (err) {
-        message = "writing protocol";
-        goto abort_transaction;
-    }
-
-    snprintf(path, sizeof(path), "%s/state", nodename);
-    err = xenbus_switch_state(xbt, path, XenbusStateConnected);
+    xenbus_batch_init(&batch);
+    xenbus_batch_printf(&batch, nodename, "ring-ref", "%u", dev->ring_ref);
+    xenbus_batch_printf(&batch, nodename, "event-channel", "%u", dev->evtchn);
+    xenbus_batch_printf(&batch, nodename, "protocol", "%s",
+                        XEN_IO_PROTO_ABI_NATIVE);
+    xenbus_batch_printf(&batch, nodename, "state", "%u",
+                        XenbusStateConnected);
+    err = xenbus_batch_commit(&batch);
+    xenbus_batch_free(&batch);
     if (err) {
-        message = "switching state";
-        goto abort_transaction;
-    }
-
-
-    err = xenbus_transaction_end(xbt, 0, &retry);
-    free(err);
-    if (retry) {
-            goto again;
-        printk("completing transaction\n");
+        printk("Error %s when connecting to backend\n", err);
+        goto error;
     }
 
-    goto done;
-
-abort_transaction:
-    free(err);
-    err = xenbus_transaction_end(xbt, 1, &retry);
-    printk("Abort transaction %s\n", message);
-    goto error;
-
-done:
-
     snprintf(path, sizeof(path), "%s/backend", nodename);
     msg = xenbus_read(XBT_NIL, path, &dev->backend);
     if (msg) {
@@ -183,6 +157,7 @@ done:
 
     {
         XenbusState state;
+        int ids[5];
         char path[strlen(dev->backend) + strlen("/feature-flush-cache") + 1];
         snprintf(path, sizeof(path), "%s/mode", dev->backend);
         msg = xenbus_read(XBT_NIL, path, &c);
@@ -210,21 +185,24 @@ done:
             goto error;
         }
 
+        /* Issue all reads at once to avoid waiting for each round trip. */
         snprintf(path, sizeof(path), "%s/info", dev->backend);
-        dev->info.info = xenbus_read_integer(path);
-
+        ids[0] = xenbus_read_submit(XBT_NIL, path);
         snprintf(path, sizeof(path), "%s/sectors", dev->backend);
-        // FIXME: read_integer returns an int, so disk size limited to 1TB for now
-        dev->info.sectors = xenbus_read_integer(path);
-
+        ids[1] = xenbus_read_submit(XBT_NIL, path);
         snprintf(path, sizeof(path), "%s/sector-size", dev->backend);
-        dev->info.sector_size = xenbus_read_integer(path);
-
+        ids[2] = xenbus_read_submit(XBT_NIL, path);
         snprintf(path, sizeof(path), "%s/feature-barrier", dev->backend);
-        dev->info.barrier = xenbus_read_integer(path);
-
+        ids[3] = xenbus_read_submit(XBT_NIL, path);
         snprintf(path, sizeof(path), "%s/feature-flush-cache", dev->backend);
-        dev->info.flush = xenbus_read_integer(path);
+        ids[4] = xenbus_read_submit(XBT_NIL, path);
+
+        dev->info.info = xenbus_read_integer_collect(ids[0]);
+        // FIXME: read_integer returns an int, so disk size limited to 1TB for now
+        dev->info.sectors = xenbus_read_integer_collect(ids[1]);
+        dev->info.sector_size = xenbus_read_integer_collect(ids[2]);
+        dev->info.barrier = xenbus_read_integer_collect(ids[3]);
+        dev->info.flush = xenbus_read_integer_collect(ids[4]);
 
         *info = dev->info;
     }
@@ -317,40 +295,43 @@ static void blkfront_wait_slot(struct blkfront_dev *dev)
 	    if (!RING_FULL(&dev->ring))
 		break;
 	    /* Really no slot, go to sleep. */
-	    add_waiter(w, blkfront_queue);
+	    add_waiter(w, dev->waitq);
 	    local_irq_restore(flags);
 	    schedule();
 	    local_irq_save(flags);
 	}
-	remove_waiter(w, blkfront_queue);
+	remove_waiter(w, dev->waitq);
 	local_irq_restore(flags);
     }
 }
 
-/* Issue an aio */
-void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
+/*
+ * Issue an aio on a scattered buffer, one request segment per element of
+ * seg.  aio_buf is not used, aio_nbytes must be the total length.
+ */
+void blkfront_aio_segs(struct blkfront_aiocb *aiocbp,
+                       const struct blkfront_seg *seg, int n, int write)
 {
     struct blkfront_dev *dev = aiocbp->aio_dev;
     struct blkif_request *req;
     RING_IDX i;
     int notify;
-    int n, j;
-    uintptr_t start, end;
+    int j;
 
     // Can't io at non-sector-aligned location
     ASSERT(!(aiocbp->aio_offset & (dev->info.sector_size-1)));
-    // Can't io non-sector-sized amounts
-    ASSERT(!(aiocbp->aio_nbytes & (dev->info.sector_size-1)));
-    // Can't io non-sector-aligned buffer
-    ASSERT(!((uintptr_t) aiocbp->aio_buf & (dev->info.sector_size-1)));
+    ASSERT(n > 0 && n <= BLKIF_MAX_SEGMENTS_PER_REQUEST);
+    for (j = 0; j < n; j++) {
+        // Can't io non-sector-sized amounts or non-sector-aligned buffers
+        ASSERT(seg[j].len && !(seg[j].len & (dev->info.sector_size-1)));
+        ASSERT(!((uintptr_t) seg[j].buf & (dev->info.sector_size-1)));
+        ASSERT(((uintptr_t) seg[j].buf & ~PAGE_MASK) + seg[j].len <= PAGE_SIZE);
+    }
 
-    start = (uintptr_t)aiocbp->aio_buf & PAGE_MASK;
-    end = ((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes + PAGE_SIZE - 1) & PAGE_MASK;
-    aiocbp->n = n = (end - start) / PAGE_SIZE;
+    TRACE(BLKFRONT_AIO, (unsigned long)dev, aiocbp->aio_offset,
+          aiocbp->aio_nbytes, write);
 
-    /* qemu's IDE max multsect is 16 (8KB) and SCSI max DMA was set to 32KB,
-     * so max 44KB can't happen */
-    ASSERT(n <= BLKIF_MAX_SEGMENTS_PER_REQUEST);
+    aiocbp->n = n;
 
     blkfront_wait_slot(dev);
     i = dev->ring.req_prod_pvt;
@@ -363,20 +344,17 @@ void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
     req->sector_number = aiocbp->aio_offset / 512;
 
     for (j = 0; j < n; j++) {
-        req->seg[j].first_sect = 0;
-        req->seg[j].last_sect = PAGE_SIZE / 512 - 1;
-    }
-    req->seg[0].first_sect = ((uintptr_t)aiocbp->aio_buf & ~PAGE_MASK) / 512;
-    req->seg[n-1].last_sect = (((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes - 1) & ~PAGE_MASK) / 512;
-    for (j = 0; j < n; j++) {
-	uintptr_t data = start + j * PAGE_SIZE;
+        uintptr_t data = (uintptr_t) seg[j].buf;
+
+        req->seg[j].first_sect = (data & ~PAGE_MASK) / 512;
+        req->seg[j].last_sect = req->seg[j].first_sect + seg[j].len / 512 - 1;
         if (!write) {
             /* Trigger CoW if needed */
-            *(char*)(data + (req->seg[j].first_sect << 9)) = 0;
+            *(char*)data = 0;
             barrier();
         }
 	aiocbp->gref[j] = req->seg[j].gref =
-            gnttab_grant_access(dev->dom, virtual_to_mfn(data), write);
+            gnttab_grant_access(dev->dom, virtual_to_mfn(data & PAGE_MASK), write);
     }
 
     dev->ring.req_prod_pvt = i + 1;
@@ -386,6 +364,34 @@ void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
 
     if(notify) notify_remote_via_evtchn(dev->evtchn);
 }
+EXPORT_SYMBOL(blkfront_aio_segs);
+
+/* Issue an aio */
+void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
+{
+    struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkfront_seg seg[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    int n;
+    uintptr_t start, end, data;
+
+    // Can't io non-sector-sized amounts
+    ASSERT(!(aiocbp->aio_nbytes & (dev->info.sector_size-1)));
+    // Can't io non-sector-aligned buffer
+    ASSERT(!((uintptr_t) aiocbp->aio_buf & (dev->info.sector_size-1)));
+
+    /* qemu's IDE max multsect is 16 (8KB) and SCSI max DMA was set to 32KB,
+     * so max 44KB can't happen */
+    start = (uintptr_t)aiocbp->aio_buf;
+    end = start + aiocbp->aio_nbytes;
+    for (n = 0, data = start; data < end; n++, data = (data & PAGE_MASK) + PAGE_SIZE) {
+        ASSERT(n < BLKIF_MAX_SEGMENTS_PER_REQUEST);
+        seg[n].buf = (uint8_t *) data;
+        seg[n].len = ((data & PAGE_MASK) + PAGE_SIZE < end ?
+                      (data & PAGE_MASK) + PAGE_SIZE : end) - data;
+    }
+
+    blkfront_aio_segs(aiocbp, seg, n, write);
+}
 EXPORT_SYMBOL(blkfront_aio);
 
 static void blkfront_aio_cb(struct blkfront_aiocb *aiocbp, int ret)
@@ -410,12 +416,12 @@ void blkfront_io(struct blkfront_aiocb *aiocbp, int write)
 	if (aiocbp->data)
 	    break;
 
-	add_waiter(w, blkfront_queue);
+	add_waiter(w, aiocbp->aio_dev->waitq);
 	local_irq_restore(flags);
 	schedule();
 	local_irq_save(flags);
     }
-    remove_waiter(w, blkfront_queue);
+    remove_waiter(w, aiocbp->aio_dev->waitq);
     local_irq_restore(flags);
 }
 EXPORT_SYMBOL(blkfront_io);
@@ -468,12 +474,12 @@ void blkfront_sync(struct blkfront_dev *dev)
 	if (RING_FREE_REQUESTS(&dev->ring) == RING_SIZE(&dev->ring))
 	    break;
 
-	add_waiter(w, blkfront_queue);
+	add_waiter(w, dev->waitq);
 	local_irq_restore(flags);
 	schedule();
 	local_irq_save(flags);
     }
-    remove_waiter(w, blkfront_queue);
+    remove_waiter(w, dev->waitq);
     local_irq_restore(flags);
 }
 EXPORT_SYMBOL(blkfront_sync);
@@ -492,8 +498,8 @@ moretodo:
 
         if ( file )
         {
-            file->read = false;
-            mb(); /* Make sure to let the handler set read to 1 before we start looking at the ring */
+            file_clear_events(file, POLLIN);
+            mb(); /* Make sure to let the handler set POLLIN before we start looking at the ring */
         }
     }
 #endif
@@ -556,6 +562,10 @@ moretodo:
             break;
     }
 
+    /* Other threads may be waiting for the requests completed here. */
+    if (nr_consumed)
+        wake_up(&dev->waitq);
+
     RING_FINAL_CHECK_FOR_RESPONSES(&dev->ring, more);
     if (more) goto moretodo;
 
@@ -564,31 +574,14 @@ moretodo:
 EXPORT_SYMBOL(blkfront_aio_poll);
 
 #ifdef HAVE_LIBC
-static int blkfront_posix_rwop(struct file *file, uint8_t *buf, size_t count,
-                               bool write)
+/*
+ * Check an access at offset, clipping reads to the end of the disk.
+ * Returns -1 with errno set if the access isn't possible.
+ */
+static int blkfront_posix_check(struct blkfront_dev *dev, off_t offset,
+                                size_t *count, bool write)
 {
-   struct blkfront_dev *dev = file->dev;
-   off_t offset = file->offset;
-   struct blkfront_aiocb aiocb;
    unsigned long long disksize = dev->info.sectors * dev->info.sector_size;
-   unsigned int blocksize = dev->info.sector_size;
-
-   int blknum;
-   int blkoff;
-   size_t bytes;
-   int rc = 0;
-   int alignedbuf = 0;
-   uint8_t* copybuf = NULL;
-
-   /* RW 0 bytes is just a NOP */
-   if(count == 0) {
-      return 0;
-   }
-   /* Check for NULL buffer */
-   if( buf == NULL ) {
-      errno = EFAULT;
-      return -1;
-   }
 
    /* Write mode checks */
    if(write) {
@@ -599,7 +592,7 @@ static int blkfront_posix_rwop(struct file *file, uint8_t *buf, size_t count,
          return -1;
       }
       /*Make sure disk is big enough for this write */
-      if(offset + count > disksize) {
+      if(offset + *count > disksize) {
          errno = ENOSPC;
          return -1;
       }
@@ -609,15 +602,49 @@ static int blkfront_posix_rwop(struct file *file, uint8_t *buf, size_t count,
    {
       /* Reading past the disk? Just return 0 */
       if(offset >= disksize) {
+         *count = 0;
          return 0;
       }
 
       /*If the requested read is bigger than the disk, just
        * read as much as we can until the end */
-      if(offset + count > disksize) {
-         count = disksize - offset;
+      if(offset + *count > disksize) {
+         *count = disksize - offset;
       }
    }
+
+   return 0;
+}
+
+static int blkfront_posix_rwop(struct file *file, uint8_t *buf, size_t count,
+                               off_t offset, bool write)
+{
+   struct blkfront_dev *dev = file->dev;
+   struct blkfront_aiocb aiocb;
+   unsigned int blocksize = dev->info.sector_size;
+
+   int blknum;
+   int blkoff;
+   size_t bytes;
+   int rc = 0;
+   int alignedbuf = 0;
+   uint8_t* copybuf = NULL;
+
+   /* RW 0 bytes is just a NOP */
+   if(count == 0) {
+      return 0;
+   }
+   /* Check for NULL buffer */
+   if( buf == NULL ) {
+      errno = EFAULT;
+      return -1;
+   }
+
+   if(blkfront_posix_check(dev, offset, &count, write))
+      return -1;
+   if(count == 0)
+      return 0;
+
    /* Determine which block to start at and at which offset inside of it */
    blknum = offset / blocksize;
    blkoff = offset % blocksize;
@@ -643,6 +670,8 @@ static int blkfront_posix_rwop(struct file *file, uint8_t *buf, size_t count,
    }
 
    rc = count;
+   if(write)
+      down(&dev->rmw_sem);
    while(count > 0) {
       /* determine how many bytes to read/write from/to the current block buffer */
       if(!alignedbuf || blkoff != 0 || count < blocksize) {
@@ -686,7 +715,7 @@ static int blkfront_posix_rwop(struct file *file, uint8_t *buf, size_t count,
             /* If not then we have to do a copy. */
             aiocb.aio_buf = copybuf;
             /* If we're writing a partial block, we need to read the current contents first
-             * so we don't overwrite the extra bits with garbage */
+             * so we don't overwrite the extra bits with garbage. */
             if(blkoff != 0 || bytes < blocksize) {
                blkfront_read(&aiocb);
             }
@@ -708,21 +737,213 @@ static int blkfront_posix_rwop(struct file *file, uint8_t *buf, size_t count,
          aiocb.aio_offset += bytes;
       }
    }
+   if(write)
+      up(&dev->rmw_sem);
 
    free(copybuf);
-   file->offset += rc;
    return rc;
 
 }
 
+/*
+ * read() and write() are serialised, as they use the file offset.  All
+ * other state is per call, so pread() and readv() may run concurrently,
+ * each with its own requests in flight.  Writes additionally take
+ * rmw_sem for their whole length, see struct blkfront_dev.
+ */
 static int blkfront_posix_read(struct file *file, void *buf, size_t nbytes)
 {
-    return blkfront_posix_rwop(file, buf, nbytes, false);
+    struct blkfront_dev *dev = file->dev;
+    int ret;
+
+    down(&dev->offset_sem);
+    ret = blkfront_posix_rwop(file, buf, nbytes, file->offset, false);
+    if (ret > 0)
+        file->offset += ret;
+    up(&dev->offset_sem);
+
+    return ret;
 }
 
 static int blkfront_posix_write(struct file *file, const void *buf, size_t nbytes)
 {
-    return blkfront_posix_rwop(file, (void *)buf, nbytes, true);
+    struct blkfront_dev *dev = file->dev;
+    int ret;
+
+    down(&dev->offset_sem);
+    ret = blkfront_posix_rwop(file, (void *)buf, nbytes, file->offset, true);
+    if (ret > 0)
+        file->offset += ret;
+    up(&dev->offset_sem);
+
+    return ret;
+}
+
+/* Requests of a vectored access in flight at a time. */
+#define BLKFRONT_POSIX_REQS 8
+
+struct blkfront_posix_batch {
+    int pending;
+    int error;
+};
+
+static void blkfront_posix_batch_cb(struct blkfront_aiocb *aiocbp, int ret)
+{
+    struct blkfront_posix_batch *batch = aiocbp->data;
+
+    if (ret)
+        batch->error = ret;
+    batch->pending--;
+}
+
+static void blkfront_posix_batch_wait(struct blkfront_dev *dev,
+                                      struct blkfront_posix_batch *batch)
+{
+    unsigned long flags;
+    DEFINE_WAIT(w);
+
+    local_irq_save(flags);
+    while (1) {
+	blkfront_aio_poll(dev);
+	if (!batch->pending)
+	    break;
+
+	add_waiter(w, dev->waitq);
+	local_irq_restore(flags);
+	schedule();
+	local_irq_save(flags);
+    }
+    remove_waiter(w, dev->waitq);
+    local_irq_restore(flags);
+}
+
+/*
+ * Vectored access.  If offset and all buffers are sector aligned, the
+ * buffers are mapped directly onto request segments, with up to
+ * BLKFRONT_POSIX_REQS requests in flight.  Otherwise each buffer goes
+ * through blkfront_posix_rwop().
+ */
+static int blkfront_posix_rwv(struct file *file, const struct iovec *iov,
+                              int iovcnt, off_t *pos, bool write)
+{
+    struct blkfront_dev *dev = file->dev;
+    unsigned int sector_size = dev->info.sector_size;
+    struct blkfront_aiocb aiocb[BLKFRONT_POSIX_REQS];
+    struct blkfront_seg seg[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    struct blkfront_posix_batch batch = { 0, 0 };
+    struct blkfront_aiocb *a;
+    off_t offset = *pos;
+    size_t count = 0, left, bytes, len;
+    uint8_t *buf = NULL;
+    bool aligned = !(offset & (sector_size - 1));
+    int i, n, nreq = 0, ret;
+
+    for (i = 0; i < iovcnt; i++) {
+        count += iov[i].iov_len;
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) & (sector_size - 1))
+            aligned = false;
+    }
+
+    if (!aligned) {
+        for (i = 0, count = 0; i < iovcnt; i++) {
+            ret = blkfront_posix_rwop(file, iov[i].iov_base, iov[i].iov_len,
+                                      offset + count, write);
+            if (ret < 0) {
+                if (!i)
+                    return -1;
+                break;
+            }
+            count += ret;
+            if (ret < iov[i].iov_len)
+                break;
+        }
+        *pos += count;
+        return count;
+    }
+
+    if (blkfront_posix_check(dev, offset, &count, write))
+        return -1;
+
+    if (write)
+        down(&dev->rmw_sem);
+    i = -1;
+    for (left = 0, bytes = count; bytes; ) {
+        /* Fill one request, splitting buffers at page boundaries. */
+        a = &aiocb[nreq++];
+        a->aio_dev = dev;
+        a->aio_offset = offset;
+        a->aio_nbytes = 0;
+        a->aio_cb = blkfront_posix_batch_cb;
+        a->data = &batch;
+        for (n = 0; n < BLKIF_MAX_SEGMENTS_PER_REQUEST && bytes; n++) {
+            while (!left) {
+                i++;
+                buf = iov[i].iov_base;
+                left = iov[i].iov_len;
+            }
+            len = PAGE_SIZE - ((uintptr_t)buf & ~PAGE_MASK);
+            if (len > left)
+                len = left;
+            if (len > bytes)
+                len = bytes;
+            seg[n].buf = buf;
+            seg[n].len = len;
+            buf += len;
+            left -= len;
+            bytes -= len;
+            a->aio_nbytes += len;
+        }
+        a->aio_buf = seg[0].buf;
+        offset += a->aio_nbytes;
+
+        batch.pending++;
+        blkfront_aio_segs(a, seg, n, write);
+
+        if (nreq == BLKFRONT_POSIX_REQS || !bytes) {
+            blkfront_posix_batch_wait(dev, &batch);
+            nreq = 0;
+        }
+    }
+    if (write)
+        up(&dev->rmw_sem);
+
+    if (batch.error) {
+        errno = EIO;
+        return -1;
+    }
+
+    *pos += count;
+    return count;
+}
+
+/* Like read() and write(), readv() and writev() are serialised. */
+static int blkfront_posix_rwv_locked(struct file *file,
+                                     const struct iovec *iov, int iovcnt,
+                                     off_t *pos, bool write)
+{
+    struct blkfront_dev *dev = file->dev;
+    int ret;
+
+    if (pos != &file->offset)
+        return blkfront_posix_rwv(file, iov, iovcnt, pos, write);
+
+    down(&dev->offset_sem);
+    ret = blkfront_posix_rwv(file, iov, iovcnt, pos, write);
+    up(&dev->offset_sem);
+
+    return ret;
+}
+
+static int blkfront_posix_readv(struct file *file, const struct iovec *iov,
+                                int iovcnt, off_t *pos)
+{
+    return blkfront_posix_rwv_locked(file, iov, iovcnt, pos, false);
+}
+
+static int blkfront_posix_writev(struct file *file, const struct iovec *iov,
+                                 int iovcnt, off_t *pos)
+{
+    return blkfront_posix_rwv_locked(file, iov, iovcnt, pos, true);
 }
 
 static int blkfront_posix_fstat(struct file *file, struct stat *buf)
@@ -749,10 +970,13 @@ static const struct file_ops blk_ops = {
     .name = "blk",
     .read = blkfront_posix_read,
     .write = blkfront_posix_write,
+    .readv = blkfront_posix_readv,
+    .writev = blkfront_posix_writev,
     .lseek = lseek_default,
     .close = blkfront_close_fd,
     .fstat = blkfront_posix_fstat,
     .select_rd = select_read_flag,
+    .notify = true,
 };
 
 static unsigned int ftype_blk;
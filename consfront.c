@@ -243,6 +243,21 @@ static int console_write(struct file *file, const void *buf, size_t nbytes)
     return nbytes;
 }
 
+static int console_writev(struct file *file, const struct iovec *iov,
+                          int iovcnt, off_t *pos)
+{
+    int i, ret = 0;
+
+    for ( i = 0; i < iovcnt; i++ )
+    {
+        console_print_no_notify(file->dev, iov[i].iov_base, iov[i].iov_len);
+        ret += iov[i].iov_len;
+    }
+    console_notify(file->dev);
+
+    return ret;
+}
+
 static int consfront_close_fd(struct file *file)
 {
     fini_consfront(file->dev);
@@ -278,6 +293,7 @@ const struct file_ops console_ops = {
     .name = "console",
     .read = consfront_read,
     .write = console_write,
+    .writev = console_writev,
     .close = consfront_close_fd,
     .fstat = consfront_fstat,
     .select_rd = consfront_select_rd,
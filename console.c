@@ -78,74 +78,43 @@ void xencons_tx(void)
 }
 #endif
 
-void console_print(struct consfront_dev *dev, const char *data, int length)
-{
-    char *curr_char, saved_char;
-    char copied_str[length+1];
-    char *copied_ptr;
-    int part_len;
-    int (*ring_send_fn)(struct consfront_dev *dev, const char *data,
-                        unsigned int length);
-
-    if ( !console_initialised )
-        ring_send_fn = xencons_ring_send_no_notify;
-    else
-        ring_send_fn = xencons_ring_send;
-
-    if ( dev && dev->is_raw )
-    {
-        ring_send_fn(dev, data, length);
-        return;
-    }
-
-    copied_ptr = copied_str;
-    memcpy(copied_ptr, data, length);
-    for ( curr_char = copied_ptr; curr_char < copied_ptr + length - 1;
-          curr_char++ )
-    {
-        if ( *curr_char == '\n' )
-        {
-            *curr_char = '\r';
-            saved_char = *(curr_char + 1);
-            *(curr_char + 1) = '\n';
-            part_len = curr_char - copied_ptr + 2;
-            ring_send_fn(dev, copied_ptr, part_len);
-            *(curr_char + 1) = saved_char;
-            copied_ptr = curr_char + 1;
-            length -= part_len - 1;
-        }
-    }
-
-    if ( copied_ptr[length - 1] == '\n')
-    {
-        copied_ptr[length - 1] = '\r';
-        copied_ptr[length] = '\n';
-        length++;
-    }
-
-    ring_send_fn(dev, copied_ptr, length);
-}
-EXPORT_SYMBOL(console_print);
+/*
+ * There is only one vcpu and threads are never preempted while printing, so
+ * print() can only be reentered from interrupt handlers. Those nest strictly,
+ * so using one buffer per nesting level makes print() reentrant without any
+ * locking.
+ */
+#define PRINT_NEST_MAX  4
 
 void print(int direct, const char *fmt, va_list args)
 {
-    static char __print_buf[1024];
+    static char print_bufs[PRINT_NEST_MAX][1024];
+    static unsigned int print_nest;
+    char *buf;
+    int len;
+
+    if ( print_nest >= PRINT_NEST_MAX )
+        return;
+    buf = print_bufs[print_nest++];
 
-    (void)vsnprintf(__print_buf, sizeof(__print_buf), fmt, args);
+    len = vsnprintf(buf, sizeof(print_bufs[0]), fmt, args);
+    if ( len >= sizeof(print_bufs[0]) )
+        len = sizeof(print_bufs[0]) - 1;
 
     if ( direct )
     {
-        (void)HYPERVISOR_console_io(CONSOLEIO_write, strlen(__print_buf),
-                                    __print_buf);
-        return;
+        (void)HYPERVISOR_console_io(CONSOLEIO_write, len, buf);
+        goto out;
     }
 #ifndef CONFIG_USE_XEN_CONSOLE
     if ( !console_initialised )
 #endif
-        (void)HYPERVISOR_console_io(CONSOLEIO_write, strlen(__print_buf),
-                                    __print_buf);
+        (void)HYPERVISOR_console_io(CONSOLEIO_write, len, buf);
+
+    console_print(NULL, buf, len);
 
-    console_print(NULL, __print_buf, strlen(__print_buf));
+ out:
+    print_nest--;
 }
 
 void printk(const char *fmt, ...)
@@ -233,8 +202,13 @@ static inline struct xencons_interface *xencons_interface(void)
     return console_evtchn ? console_ring : NULL;
 }
 
-int xencons_ring_send_no_notify(struct consfront_dev *dev, const char *data,
-                                unsigned int len)
+/*
+ * Copy data to the output ring, optionally translating "\n" to "\r\n".
+ * Data not fitting into the ring is dropped. The producer index is updated
+ * only once, the daemon is not notified.
+ */
+static int xencons_ring_write(struct consfront_dev *dev, const char *data,
+                              unsigned int len, bool crlf)
 {
     int sent = 0;
     struct xencons_interface *intf;
@@ -253,7 +227,15 @@ int xencons_ring_send_no_notify(struct consfront_dev *dev, const char *data,
     BUG_ON((prod - cons) > sizeof(intf->out));
 
     while ( (sent < len) && ((prod - cons) < sizeof(intf->out)) )
+    {
+        if ( crlf && data[sent] == '\n' )
+        {
+            if ( (prod - cons) + 2 > sizeof(intf->out) )
+                break;
+            intf->out[MASK_XENCONS_IDX(prod++, intf->out)] = '\r';
+        }
         intf->out[MASK_XENCONS_IDX(prod++, intf->out)] = data[sent++];
+    }
 
     wmb();
     intf->out_prod = prod;
@@ -261,6 +243,12 @@ int xencons_ring_send_no_notify(struct consfront_dev *dev, const char *data,
     return sent;
 }
 
+int xencons_ring_send_no_notify(struct consfront_dev *dev, const char *data,
+                                unsigned int len)
+{
+    return xencons_ring_write(dev, data, len, false);
+}
+
 int xencons_ring_send(struct consfront_dev *dev, const char *data,
                       unsigned int len)
 {
@@ -272,6 +260,30 @@ int xencons_ring_send(struct consfront_dev *dev, const char *data,
     return sent;
 }
 
+/* As console_print(), leaving the notification to console_notify(). */
+void console_print_no_notify(struct consfront_dev *dev, const char *data,
+                             int length)
+{
+    xencons_ring_write(dev, data, length, !dev || !dev->is_raw);
+}
+EXPORT_SYMBOL(console_print_no_notify);
+
+void console_notify(struct consfront_dev *dev)
+{
+    if ( console_initialised )
+        notify_daemon(dev);
+}
+EXPORT_SYMBOL(console_notify);
+
+void console_print(struct consfront_dev *dev, const char *data, int length)
+{
+    console_print_no_notify(dev, data, length);
+
+    /* A single notification for the whole message. */
+    console_notify(dev);
+}
+EXPORT_SYMBOL(console_print);
+
 void console_handle_input(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
     struct consfront_dev *dev = (struct consfront_dev *) data;
@@ -279,7 +291,7 @@ void console_handle_input(evtchn_port_t port, struct pt_regs *regs, void *data)
     struct file *file = dev ? get_file_from_fd(dev->fd) : NULL;
 
     if ( file )
-        file->read = true;
+        file_set_events(file, POLLIN);
 
     wake_up(&console_queue);
 #else
@@ -21,6 +21,7 @@
 #include <mini-os/hypervisor.h>
 #include <mini-os/events.h>
 #include <mini-os/lib.h>
+#include <mini-os/trace.h>
 #include <xen/xsm/flask_op.h>
 
 #define NR_EVS EVTCHN_2L_NR_CHANNELS
@@ -76,6 +77,7 @@ int do_event(evtchn_port_t port, struct pt_regs *regs)
 
     action = &ev_actions[port];
     action->count++;
+    TRACE(DO_EVENT, port);
 
     /* call the handler */
 	action->handler(port, regs, action->data);
@@ -48,7 +48,7 @@ void kbdfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
     struct file *file = get_file_from_fd(dev->fd);
 
     if ( file )
-        file->read = true;
+        file_set_events(file, POLLIN);
 #endif
     wake_up(&kbdfront_queue);
 }
@@ -213,8 +213,8 @@ int kbdfront_receive(struct kbdfront_dev *dev, union xenkbd_in_event *buf, int n
 
     if ( file )
     {
-        file->read = false;
-        mb(); /* Make sure to let the handler set read to 1 before we start looking at the ring */
+        file_clear_events(file, POLLIN);
+        mb(); /* Make sure to let the handler set POLLIN before we start looking at the ring */
     }
 #endif
 
@@ -235,7 +235,7 @@ int kbdfront_receive(struct kbdfront_dev *dev, union xenkbd_in_event *buf, int n
 #ifdef HAVE_LIBC
     if ( cons != prod && file )
         /* still some events to read */
-        file->read = true;
+        file_set_events(file, POLLIN);
 #endif
 
     return i;
@@ -332,6 +332,7 @@ static struct file_ops kbd_ops = {
     .read = kbd_read,
     .close = kbd_close_fd,
     .select_rd = select_read_flag,
+    .notify = true,
 };
 
 static unsigned int ftype_kbd;
@@ -398,7 +399,7 @@ void fbfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
     struct file *file = get_file_from_fd(dev->fd);
 
     if ( file )
-        file->read = true;
+        file_set_events(file, POLLIN);
 #endif
     wake_up(&fbfront_queue);
 }
@@ -427,8 +428,8 @@ int fbfront_receive(struct fbfront_dev *dev, union xenfb_in_event *buf, int n)
 
     if ( file )
     {
-        file->read = false;
-        mb(); /* Make sure to let the handler set read to 1 before we start looking at the ring */
+        file_clear_events(file, POLLIN);
+        mb(); /* Make sure to let the handler set POLLIN before we start looking at the ring */
     }
 #endif
 
@@ -449,7 +450,7 @@ int fbfront_receive(struct fbfront_dev *dev, union xenfb_in_event *buf, int n)
 #ifdef HAVE_LIBC
     if ( cons != prod && file )
         /* still some events to read */
-        file->read = true;
+        file_set_events(file, POLLIN);
 #endif
 
     return i;
@@ -782,6 +783,7 @@ static const struct file_ops fb_ops = {
     .read = fbfront_read,
     .close = fbfront_close_fd,
     .select_rd = select_read_flag,
+    .notify = true,
 };
 
 static unsigned int ftype_fb;
@@ -1,7 +1,13 @@
 #ifndef __9PFRONT_H__
 #define __9PFRONT_H__
 
+/* Page cache modes for regular files, P9FRONT_CACHE_NONE is the default. */
+#define P9FRONT_CACHE_NONE          0
+#define P9FRONT_CACHE_WRITETHROUGH  1
+#define P9FRONT_CACHE_WRITEBACK     2
+
 void *init_9pfront(unsigned int id, const char *mnt);
 void shutdown_9pfront(void *dev);
+void set_cache_9pfront(void *dev, unsigned int mode);
 
 #endif /* __9PFRONT_H__ */
@@ -17,6 +17,12 @@ struct blkfront_aiocb
 
     void (*aio_cb)(struct blkfront_aiocb *aiocb, int ret);
 };
+/* Part of a scattered buffer, sector aligned and within one page. */
+struct blkfront_seg
+{
+    uint8_t *buf;
+    unsigned int len;
+};
 struct blkfront_info
 {
     uint64_t sectors;
@@ -36,6 +42,8 @@ struct blkfront_dev *init_blkfront(char *nodename, struct blkfront_info *info);
 int blkfront_open(struct blkfront_dev *dev);
 #endif
 void blkfront_aio(struct blkfront_aiocb *aiocbp, int write);
+void blkfront_aio_segs(struct blkfront_aiocb *aiocbp,
+                       const struct blkfront_seg *seg, int n, int write);
 #define blkfront_aio_read(aiocbp) blkfront_aio(aiocbp, 0)
 #define blkfront_aio_write(aiocbp) blkfront_aio(aiocbp, 1)
 void blkfront_io(struct blkfront_aiocb *aiocbp, int write);
@@ -79,6 +79,9 @@ void xencons_tx(void);
 void get_console(void);
 void init_console(void);
 void console_print(struct consfront_dev *dev, const char *data, int length);
+void console_print_no_notify(struct consfront_dev *dev, const char *data,
+                             int length);
+void console_notify(struct consfront_dev *dev);
 void fini_consfront(struct consfront_dev *dev);
 void suspend_console(void);
 void resume_console(void);
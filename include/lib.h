@@ -68,6 +68,8 @@
 #ifdef HAVE_LIBC
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #else
@@ -161,6 +163,8 @@ void sanity_check(void);
 domid_t get_domid(void);
 
 #ifdef HAVE_LIBC
+#include <mini-os/waittypes.h>
+
 extern struct wait_queue_head event_queue;
 
 #define FTYPE_NONE       0
@@ -168,13 +172,20 @@ extern struct wait_queue_head event_queue;
 #define FTYPE_FILE       2
 #define FTYPE_SOCKET     3
 #define FTYPE_MEM        4
-#define FTYPE_N          5
+#define FTYPE_EPOLL      5
+#define FTYPE_N          6
 #define FTYPE_SPARE     16
 
+struct epoll_item;
+
 struct file {
     unsigned int type;
-    bool read;	/* maybe available for read */
+    /* Maybe available for read, for types not using file_set_events(). */
+    bool read;
+    uint32_t events;            /* POLLIN/POLLOUT maybe available */
     off_t offset;
+    struct wait_queue_head waitq;   /* Woken by file_set_events(). */
+    struct epoll_item *epoll;   /* epoll instances watching this file */
     union {
         int fd; /* Any fd from an upper layer. */
         void *dev;
@@ -186,23 +197,43 @@ struct file_ops {
     const char *name;
     int (*read)(struct file *file, void *buf, size_t nbytes);
     int (*write)(struct file *file, const void *buf, size_t nbytes);
+    /*
+     * Vectored I/O at *pos, which is advanced by the number of bytes
+     * transferred.  readv()/writev() pass &file->offset.  Types without
+     * them get emulated ones, looping over read/write.
+     */
+    int (*readv)(struct file *file, const struct iovec *iov, int iovcnt,
+                 off_t *pos);
+    int (*writev)(struct file *file, const struct iovec *iov, int iovcnt,
+                  off_t *pos);
     off_t (*lseek)(struct file *file, off_t offset, int whence);
     int (*close)(struct file *file);
     int (*fstat)(struct file *file, struct stat *buf);
+    int (*fsync)(struct file *file);
+    /* Returns number of entries in *names (allocated), 0 at end, or -1. */
+    int (*readdir)(struct file *file, char ***names);
     int (*fcntl)(struct file *file, int cmd, va_list args);
     bool (*select_rd)(struct file *file);
     bool (*select_wr)(struct file *file);
+    /*
+     * Changes of select_rd/select_wr are signalled via file_set_events()
+     * or file_notify().
+     */
+    bool notify;
 };
 
 struct mount_point {
     const char *path;
     int (*open)(struct mount_point *mnt, const char *pathname, int flags,
                 mode_t mode);
+    int (*remove)(struct mount_point *mnt, const char *pathname);
     void *dev;
 };
 
 int mount(const char *path, void *dev,
           int (*open)(struct mount_point *, const char *, int, mode_t));
+void mount_set_remove(const char *path,
+                      int (*remove)(struct mount_point *, const char *));
 void umount(const char *path);
 
 unsigned int alloc_file_type(const struct file_ops *ops);
@@ -210,12 +241,18 @@ unsigned int alloc_file_type(const struct file_ops *ops);
 off_t lseek_default(struct file *file, off_t offset, int whence);
 bool select_yes(struct file *file);
 bool select_read_flag(struct file *file);
+void file_notify(struct file *file);
+void file_set_events(struct file *file, uint32_t events);
+void file_clear_events(struct file *file, uint32_t events);
 
 struct file *get_file_from_fd(int fd);
 int alloc_fd(unsigned int type);
 void close_all_files(void);
 extern struct thread *main_thread;
 void sparse(unsigned long data, size_t size);
+/* Populate a page of a file mapping on a fault at addr, 1 if handled. */
+struct pt_regs;
+int mmap_fault(struct pt_regs *regs, unsigned long addr, bool write);
 
 int close(int fd);
 #endif
@@ -17,7 +17,33 @@
 #define LWIP_IGMP 1
 #define LWIP_USE_HEAP_FROM_INTERRUPT 1
 #define MEMP_NUM_SYS_TIMEOUT 10
+
+#ifdef CONFIG_LWIP_THROUGHPUT
+/*
+ * High throughput profile, trading memory for bulk TCP transfers.
+ * lwIP 1.3 windows are 16 bits (there is no window scaling), so both
+ * windows are the largest multiple of the MSS below 64k.
+ */
+#define TCP_MSS 1460
+#define TCP_WND (44 * TCP_MSS)
+#define TCP_SND_BUF (44 * TCP_MSS)
+#define TCP_SND_QUEUELEN (4 * TCP_SND_BUF / TCP_MSS)
+#define MEMP_NUM_TCP_SEG TCP_SND_QUEUELEN
+/* As many pool pbufs (one full frame each) as netfront RX ring slots. */
+#define PBUF_POOL_SIZE 256
+/* Absorb a whole RX ring and a whole window without dropping. */
+#define TCPIP_MBOX_SIZE PBUF_POOL_SIZE
+#define DEFAULT_TCP_RECVMBOX_SIZE 128
+#define DEFAULT_UDP_RECVMBOX_SIZE 128
+#define DEFAULT_ACCEPTMBOX_SIZE 16
+#else
 #define TCP_SND_BUF 3000
 #define TCP_MSS 1500
+#endif
+
+#ifdef CONFIG_LWIP_RX_THREAD
+/* netfront_rx_thread() feeds lwIP directly, holding the core lock. */
+#define LWIP_TCPIP_CORE_LOCKING 1
+#endif
 
 #endif /* __LWIP_LWIPOPTS_H__ */
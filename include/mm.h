@@ -84,6 +84,7 @@ int do_map_frames(unsigned long addr,
         const unsigned long *f, unsigned long n, unsigned long stride,
 	unsigned long increment, domid_t id, int *err, unsigned long prot);
 int unmap_frames(unsigned long va, unsigned long num_frames);
+int remap_frame(unsigned long va, unsigned long mfn, unsigned long prot);
 int map_frame_rw(unsigned long addr, unsigned long mfn);
 unsigned long map_frame_virt(unsigned long mfn);
 #ifdef HAVE_LIBC
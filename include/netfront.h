@@ -12,6 +12,16 @@ char *netfront_get_netmask(struct netfront_dev *dev);
 char *netfront_get_gateway(struct netfront_dev *dev);
 void netfront_xmit(struct netfront_dev *dev, const unsigned char *data,
                    int len);
+void netfront_xmit_ref(struct netfront_dev *dev, const unsigned char *data,
+                       int len, void (*done)(void *arg), void *arg);
+void netfront_set_rx_handler(struct netfront_dev *dev,
+                             void (*thenetif_rx)(unsigned char *data, int len,
+                                                 void *arg),
+                             void *arg);
+void netfront_set_rx_poll(struct netfront_dev *dev,
+                          struct wait_queue_head *waitq);
+int netfront_rx_pending(struct netfront_dev *dev);
+void netfront_rx_poll(struct netfront_dev *dev);
 void shutdown_netfront(struct netfront_dev *dev);
 void suspend_netfront(void);
 void resume_netfront(void);
@@ -30,4 +40,6 @@ void start_networking(void);
 void stop_networking(void);
 
 void networking_set_addr(struct ip_addr *ipaddr, struct ip_addr *netmask, struct ip_addr *gw);
+int networking_set_if_addr(unsigned int n, struct ip_addr *ipaddr,
+                           struct ip_addr *netmask, struct ip_addr *gw);
 #endif
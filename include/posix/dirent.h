@@ -10,7 +10,7 @@ struct dirent {
 typedef struct {
         struct dirent dirent;
         char *name;
-        int32_t offset;
+        int fd;
         char **entries;
         int32_t curentry;
         int32_t nbentries;
@@ -0,0 +1,41 @@
+#ifndef _POSIX_SYS_EPOLL_H
+#define _POSIX_SYS_EPOLL_H
+
+#include <stdint.h>
+
+/* Same values as the corresponding POLL* events. */
+#define EPOLLIN		0x001
+#define EPOLLPRI	0x002
+#define EPOLLOUT	0x004
+#define EPOLLERR	0x008
+#define EPOLLHUP	0x010
+
+#define EPOLLONESHOT	(1U << 30)
+#define EPOLLET		(1U << 31)
+
+#define EPOLL_CTL_ADD	1
+#define EPOLL_CTL_DEL	2
+#define EPOLL_CTL_MOD	3
+
+/* There is no exec, so this is accepted and ignored. */
+#define EPOLL_CLOEXEC	02000000
+
+typedef union epoll_data {
+	void *ptr;
+	int fd;
+	uint32_t u32;
+	uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+	uint32_t events;
+	epoll_data_t data;
+};
+
+int epoll_create(int size);
+int epoll_create1(int flags);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+	       int timeout);
+
+#endif /* _POSIX_SYS_EPOLL_H */
@@ -14,8 +14,18 @@
 
 #define MAP_FAILED	((void*)0)
 
+/* Write back is always synchronous. */
+#define MS_ASYNC	0x1
+#define MS_INVALIDATE	0x2
+#define MS_SYNC		0x4
+
+/*
+ * Seekable files can be mapped too, their pages are read on first access.
+ * Mappings outlive the fd: the file is only closed once it is unmapped.
+ */
 void *mmap(void *start, size_t length, int prot, int flags, int fd, off_t offset) asm("mmap64");
 int munmap(void *start, size_t length);
+int msync(void *start, size_t length, int flags);
 static inline int mlock(const void *addr, size_t len) { return 0; }
 static inline int munlock(const void *addr, size_t len) { return 0; }
 
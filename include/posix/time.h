@@ -3,6 +3,9 @@
 
 #include <sys/time.h>
 #define CLOCK_MONOTONIC	2
+#define CLOCK_MONOTONIC_RAW	4
+#define CLOCK_REALTIME_COARSE	5
+#define CLOCK_MONOTONIC_COARSE	6
 #include_next <time.h>
 
 int nanosleep(const struct timespec *req, struct timespec *rem);
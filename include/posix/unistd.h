@@ -11,6 +11,8 @@ int gethostname(char *name, size_t namelen);
 size_t getpagesize(void);
 int ftruncate(int fd, off_t length);
 int lockf(int fd, int cmd, off_t len);
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset);
 int nice(int inc);
 
 #endif /* _POSIX_UNISTD_H */
@@ -58,6 +58,8 @@ void     fini_time(void);
 s_time_t get_s_time(void);
 s_time_t get_v_time(void);
 uint64_t monotonic_clock(void);
+uint64_t monotonic_clock_coarse(void);
+uint64_t wallclock_base(void);
 void     block_domain(s_time_t until);
 
 #endif /* _MINIOS_TIME_H_ */
@@ -0,0 +1,109 @@
+/* -*-  Mode:C; c-basic-offset:4; tab-width:4 -*-
+ *
+ * Binary tracepoints for hot paths.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <mini-os/types.h>
+
+/*
+ * All trace events, with the format of their arguments used when decoding
+ * them.  A record carries up to TRACE_ARGS integer arguments; unused ones
+ * are 0.
+ * New events are added here only, the event number is the position in
+ * the list.
+ */
+#define TRACE_EVENTS(x)                                                     \
+    x(SCHEDULE,      "prev=%llx next=%llx")                                 \
+    x(DO_EVENT,      "port=%llu")                                           \
+    x(NETFRONT_XMIT, "dev=%llx len=%llu")                                   \
+    x(BLKFRONT_AIO,  "dev=%llx offset=%llx nbytes=%llx write=%llu")
+
+enum trace_event {
+#define TRACE_ENUM(name, fmt) TRACE_##name,
+    TRACE_EVENTS(TRACE_ENUM)
+#undef TRACE_ENUM
+    TRACE_NR_EVENTS
+};
+
+#define TRACE_ARGS        4
+#define TRACE_NAME_LEN    32
+
+/* Record layout as found in memory and in a dump, independent of arch. */
+struct trace_record {
+    uint64_t time;
+    uint32_t event;
+    uint32_t seq;
+    uint64_t arg[TRACE_ARGS];
+};
+
+/*
+ * A dump is a struct trace_header, nr_events names of TRACE_NAME_LEN bytes
+ * each, then nr_records records, oldest first.
+ */
+#define TRACE_MAGIC       "MOSTRACE"
+#define TRACE_VERSION     1
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t nr_events;
+    uint32_t nr_records;
+    uint64_t lost;
+};
+
+#ifdef CONFIG_TRACE
+
+extern uint32_t trace_mask;
+
+void trace_record(unsigned int event, uint64_t a0, uint64_t a1, uint64_t a2,
+                  uint64_t a3);
+
+#define __TRACE(ev, a0, a1, a2, a3, ...)                                    \
+    trace_record(ev, a0, a1, a2, a3)
+
+/* TRACE(EVENT, args...): log an event if it is enabled in trace_mask. */
+#define TRACE(ev, ...)                                                      \
+    do {                                                                    \
+        if ( trace_mask & (1U << TRACE_##ev) )                              \
+            __TRACE(TRACE_##ev, ##__VA_ARGS__, 0, 0, 0, 0);                 \
+    } while ( 0 )
+
+void trace_set_mask(uint32_t mask);
+void trace_reset(void);
+void trace_print(void);
+#ifdef HAVE_LIBC
+int trace_dump(int fd);
+#endif
+
+#else /* CONFIG_TRACE */
+
+#define TRACE(ev, ...) do { } while ( 0 )
+
+static inline void trace_set_mask(uint32_t mask) { }
+static inline void trace_reset(void) { }
+static inline void trace_print(void) { }
+
+#endif /* CONFIG_TRACE */
+#endif /* _TRACE_H_ */
@@ -30,6 +30,19 @@ static inline void get_xenbus(void)
    set to a malloc'd copy of the value. */
 char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value);
 
+/* Asynchronous variants: the *_submit() functions send the request and
+   return its id without waiting for the reply, the *_collect() ones
+   wait for the reply of such a request and have the same semantics as
+   the synchronous function.  This allows to have multiple requests in
+   flight.  Every submitted request must be collected, and no more than
+   32 requests can be outstanding at any time. */
+int xenbus_read_submit(xenbus_transaction_t xbt, const char *path);
+char *xenbus_read_collect(int id, char **value);
+int xenbus_read_integer_collect(int id);
+int xenbus_write_submit(xenbus_transaction_t xbt, const char *path,
+                        const char *value);
+char *xenbus_write_collect(int id);
+
 /* Watch event queue */
 struct xenbus_event {
     /* Keep these two as this for xs.c */
@@ -41,6 +54,16 @@ typedef struct xenbus_event *xenbus_event_queue;
 
 char *xenbus_watch_path_token(xenbus_transaction_t xbt, const char *path, const char *token, xenbus_event_queue *events);
 char *xenbus_unwatch_path_token(xenbus_transaction_t xbt, const char *path, const char *token);
+
+/* Watch with a callback instead of an event queue.  The callback is
+   called with the path and token of each event in the context of the
+   xenwatch thread, so it may block and issue xenbus requests.  Both
+   strings are freed after the callback returns.  Use
+   xenbus_unwatch_path_token to remove the watch. */
+typedef void (*xenbus_watch_cb_t)(char *path, char *token, void *data);
+char *xenbus_watch_path_token_cb(xenbus_transaction_t xbt, const char *path,
+                                 const char *token, xenbus_watch_cb_t cb,
+                                 void *data);
 extern struct wait_queue_head xenbus_watch_queue;
 void xenbus_wait_for_watch(xenbus_event_queue *queue);
 char **xenbus_wait_for_watch_return(xenbus_event_queue *queue);
@@ -74,6 +97,13 @@ xenbus_msg_reply(int type,
                  struct write_req *io,
                  int nr_reqs);
 
+/* Split version of xenbus_msg_reply: xenbus_msg_submit sends the
+   message and returns the request id, xenbus_msg_collect blocks
+   waiting for the reply of that request. */
+int xenbus_msg_submit(int type, xenbus_transaction_t trans,
+                      struct write_req *io, int nr_reqs);
+struct xsd_sockmsg *xenbus_msg_collect(int id);
+
 /* Removes the value associated with a path.  Returns a malloc'd error
    string on failure. */
 char *xenbus_rm(xenbus_transaction_t xbt, const char *path);
@@ -122,6 +152,35 @@ char* xenbus_printf(xenbus_transaction_t xbt,
                                   const char* fmt, ...)
                    __attribute__((__format__(printf, 4, 5)));
 
+/* Cache values read outside of transactions at or below path.  The
+   cache is kept coherent via a watch on path.  Returns a malloc'd
+   error string on failure. */
+char *xenbus_cache_path(const char *path);
+/* Stop caching values below a path passed to xenbus_cache_path. */
+char *xenbus_uncache_path(const char *path);
+
+/* A set of writes to be done in one transaction. */
+#define XENBUS_BATCH_MAX 16
+struct xenbus_batch {
+    int nr;
+    struct {
+        char *path;
+        char *value;
+    } entry[XENBUS_BATCH_MAX];
+};
+
+/* Initialise an empty batch. */
+void xenbus_batch_init(struct xenbus_batch *batch);
+/* Add a write of the formatted value to node/path to the batch. */
+void xenbus_batch_printf(struct xenbus_batch *batch, const char *node,
+                         const char *path, const char *fmt, ...)
+                   __attribute__((__format__(printf, 4, 5)));
+/* Do all writes of the batch in a single transaction, retrying the
+   transaction as needed.  Returns a malloc'd error string on failure. */
+char *xenbus_batch_commit(struct xenbus_batch *batch);
+/* Release the memory held by a batch. */
+void xenbus_batch_free(struct xenbus_batch *batch);
+
 /* Utility function to figure out our domain id */
 domid_t xenbus_get_self_id(void);
 
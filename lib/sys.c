@@ -32,6 +32,7 @@
 #include <xenbus.h>
 #include <xenstore.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <termios.h>
 
 #include <sys/types.h>
@@ -46,6 +47,7 @@
 #include <assert.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <math.h>
 
 #ifdef HAVE_LWIP
@@ -88,18 +90,29 @@
     } \
     EXPORT_SYMBOL(function)
 
-#define NOFILE 32
+/*
+ * The file table grows in chunks of NOFILE_CHUNK files, which are never
+ * moved, as struct file contains wait queue heads and is referenced by
+ * epoll items.  Used fds are tracked in a bitmap.
+ */
+#define NOFILE_CHUNK   32
+#define NOFILE_MAX     4096
+#define FD_MAP_BITS    (sizeof(unsigned long) * 8)
 #define N_MOUNTS  16
 
 extern void minios_evtchn_close_fd(int fd);
 extern void minios_gnttab_close_fd(int fd);
 
 pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct file files[NOFILE] = {
+static struct file files_initial[NOFILE_CHUNK] = {
     { .type = FTYPE_CONSOLE }, /* stdin */
     { .type = FTYPE_CONSOLE }, /* stdout */
     { .type = FTYPE_CONSOLE }, /* stderr */
 };
+static struct file *file_chunks[NOFILE_MAX / NOFILE_CHUNK] = { files_initial };
+static unsigned int nr_files = NOFILE_CHUNK;    /* fds with a slot */
+static unsigned long fd_map[NOFILE_MAX / FD_MAP_BITS] = { 7 };  /* Set: used */
+static unsigned int fd_map_hint;    /* No free fd in fd_map words below. */
 
 static const struct file_ops file_ops_none = {
     .name = "none",
@@ -121,6 +134,61 @@ static int socket_write(struct file *file, const void *buf, size_t nbytes)
     return lwip_write(file->fd, buf, nbytes);
 }
 
+/* Small writes are gathered, so they go out as one segment. */
+#define SOCKET_GATHER 512
+
+static int socket_readv(struct file *file, const struct iovec *iov,
+                        int iovcnt, off_t *pos)
+{
+    int i, n, ret = 0;
+
+    /* Only the first buffer may block. */
+    for ( i = 0; i < iovcnt; i++ )
+    {
+        if ( i )
+            n = lwip_recv(file->fd, iov[i].iov_base, iov[i].iov_len,
+                          MSG_DONTWAIT);
+        else
+            n = lwip_read(file->fd, iov[i].iov_base, iov[i].iov_len);
+        if ( n < 0 )
+            return i ? ret : -1;
+        ret += n;
+        if ( n < iov[i].iov_len )
+            break;
+    }
+
+    return ret;
+}
+
+static int socket_writev(struct file *file, const struct iovec *iov,
+                         int iovcnt, off_t *pos)
+{
+    char buf[SOCKET_GATHER];
+    size_t len = 0;
+    int i, n, ret = 0;
+
+    for ( i = 0; i < iovcnt; i++ )
+        len += iov[i].iov_len;
+    if ( len <= sizeof(buf) )
+    {
+        for ( i = 0, len = 0; i < iovcnt; len += iov[i++].iov_len )
+            memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        return lwip_write(file->fd, buf, len);
+    }
+
+    for ( i = 0; i < iovcnt; i++ )
+    {
+        n = lwip_write(file->fd, iov[i].iov_base, iov[i].iov_len);
+        if ( n < 0 )
+            return ret ? ret : -1;
+        ret += n;
+        if ( n < iov[i].iov_len )
+            break;
+    }
+
+    return ret;
+}
+
 static int close_socket_fd(struct file *file)
 {
     return lwip_close(file->fd);
@@ -157,13 +225,18 @@ static const struct file_ops socket_ops = {
     .name = "socket",
     .read = socket_read,
     .write = socket_write,
+    .readv = socket_readv,
+    .writev = socket_writev,
     .close = close_socket_fd,
     .fstat = socket_fstat,
     .fcntl = socket_fcntl,
 };
 #endif
 
-static const struct file_ops *file_ops[FTYPE_N + FTYPE_SPARE] = {
+static const struct file_ops epoll_ops;
+static void epoll_remove(struct epoll_item *item);
+
+static const struct file_ops *file_ops_initial[FTYPE_N + FTYPE_SPARE] = {
     [FTYPE_NONE] = &file_ops_none,
 #ifdef CONFIG_CONSFRONT
     [FTYPE_CONSOLE] = &console_ops,
@@ -172,16 +245,31 @@ static const struct file_ops *file_ops[FTYPE_N + FTYPE_SPARE] = {
 #ifdef HAVE_LWIP
     [FTYPE_SOCKET] = &socket_ops,
 #endif
+    [FTYPE_EPOLL] = &epoll_ops,
 };
 
+static const struct file_ops **file_ops = file_ops_initial;
+static unsigned int nr_file_ops = ARRAY_SIZE(file_ops_initial);
+
 unsigned int alloc_file_type(const struct file_ops *ops)
 {
     static unsigned int i = FTYPE_N;
+    const struct file_ops **new;
     unsigned int ret;
 
     pthread_mutex_lock(&fd_lock);
 
-    BUG_ON(i == ARRAY_SIZE(file_ops));
+    if ( i == nr_file_ops )
+    {
+        /* The old table is left alone, it might be the static one. */
+        new = malloc(2 * nr_file_ops * sizeof(*new));
+        BUG_ON(!new);
+        memcpy(new, file_ops, nr_file_ops * sizeof(*new));
+        memset(new + nr_file_ops, 0, nr_file_ops * sizeof(*new));
+        wmb();
+        file_ops = new;
+        nr_file_ops *= 2;
+    }
     ret = i++;
     file_ops[ret] = ops;
 
@@ -195,39 +283,109 @@ EXPORT_SYMBOL(alloc_file_type);
 
 static const struct file_ops *get_file_ops(unsigned int type)
 {
-    if ( type >= ARRAY_SIZE(file_ops) || !file_ops[type] )
+    if ( type >= nr_file_ops || !file_ops[type] )
         return &file_ops_none;
 
     return file_ops[type];
 }
 
-struct file *get_file_from_fd(int fd)
+/* Slot of fd, in use or not, or NULL if the table doesn't cover fd. */
+static struct file *fd_slot(int fd)
 {
-    if ( fd < 0 || fd >= ARRAY_SIZE(files) )
+    if ( fd < 0 || fd >= nr_files )
         return NULL;
 
-    return (files[fd].type == FTYPE_NONE) ? NULL : files + fd;
+    return file_chunks[fd / NOFILE_CHUNK] + (fd & (NOFILE_CHUNK - 1));
+}
+
+/* Reverse of fd_slot(). */
+static int fd_of_file(const struct file *file)
+{
+    int i;
+
+    for ( i = 0; i < nr_files / NOFILE_CHUNK; i++ )
+        if ( file >= file_chunks[i] && file < file_chunks[i] + NOFILE_CHUNK )
+            return i * NOFILE_CHUNK + (file - file_chunks[i]);
+
+    return -1;
+}
+
+struct file *get_file_from_fd(int fd)
+{
+    struct file *file = fd_slot(fd);
+
+    return (!file || file->type == FTYPE_NONE) ? NULL : file;
 }
 EXPORT_SYMBOL(get_file_from_fd);
 
 DECLARE_WAIT_QUEUE_HEAD(event_queue);
 EXPORT_SYMBOL(event_queue);
 
+/* Grow the table to cover fd, return false if not possible. */
+static bool fd_table_grow(int fd)
+{
+    struct file *chunk;
+
+    if ( fd >= NOFILE_MAX )
+        return false;
+
+    while ( fd >= nr_files )
+    {
+        chunk = calloc(NOFILE_CHUNK, sizeof(*chunk));
+        if ( !chunk )
+            return false;
+        file_chunks[nr_files / NOFILE_CHUNK] = chunk;
+        nr_files += NOFILE_CHUNK;
+    }
+
+    return true;
+}
+
+static void fd_map_set(int fd)
+{
+    fd_map[fd / FD_MAP_BITS] |= 1UL << (fd % FD_MAP_BITS);
+}
+
+static void fd_map_clear(int fd)
+{
+    fd_map[fd / FD_MAP_BITS] &= ~(1UL << (fd % FD_MAP_BITS));
+    if ( fd / FD_MAP_BITS < fd_map_hint )
+        fd_map_hint = fd / FD_MAP_BITS;
+}
+
+/* Return the lowest free fd, as required by POSIX. */
 int alloc_fd(unsigned int type)
 {
-    int i;
+    struct file *file;
+    unsigned int i;
+    int fd = -1;
+
     pthread_mutex_lock(&fd_lock);
-    for (i=0; i<NOFILE; i++) {
-	if (files[i].type == FTYPE_NONE) {
-	    files[i].type = type;
-            files[i].offset = 0;
-	    pthread_mutex_unlock(&fd_lock);
-	    return i;
-	}
+    for ( i = fd_map_hint; i < ARRAY_SIZE(fd_map); i++ )
+    {
+        if ( ~fd_map[i] )
+        {
+            fd = i * FD_MAP_BITS + __ffs(~fd_map[i]);
+            break;
+        }
+    }
+    fd_map_hint = i;
+
+    if ( fd < 0 || !fd_table_grow(fd) )
+    {
+        pthread_mutex_unlock(&fd_lock);
+        printk("Too many opened files\n");
+        do_exit();
     }
+
+    fd_map_set(fd);
+    file = fd_slot(fd);
+    file->type = type;
+    file->offset = 0;
+    init_waitqueue_head(&file->waitq);
     pthread_mutex_unlock(&fd_lock);
-    printk("Too many opened files\n");
-    do_exit();
+
+    return fd;
 }
 EXPORT_SYMBOL(alloc_fd);
 
@@ -235,8 +393,8 @@ void close_all_files(void)
 {
     int i;
     pthread_mutex_lock(&fd_lock);
-    for (i=NOFILE - 1; i > 0; i--)
-	if (files[i].type != FTYPE_NONE)
+    for (i=nr_files - 1; i > 0; i--)
+	if (get_file_from_fd(i))
             close(i);
     pthread_mutex_unlock(&fd_lock);
 }
@@ -244,13 +402,33 @@ EXPORT_SYMBOL(close_all_files);
 
 int dup2(int oldfd, int newfd)
 {
+    struct file *old = get_file_from_fd(oldfd), *new;
+
+    if ( !old || newfd < 0 )
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if ( oldfd == newfd )
+        return newfd;
+
     pthread_mutex_lock(&fd_lock);
-    if (files[newfd].type != FTYPE_NONE)
+    if ( !fd_table_grow(newfd) )
+    {
+        pthread_mutex_unlock(&fd_lock);
+        errno = EBADF;
+        return -1;
+    }
+    if (get_file_from_fd(newfd))
 	close(newfd);
+    new = fd_slot(newfd);
     // XXX: this is a bit bogus, as we are supposed to share the offset etc
-    files[newfd] = files[oldfd];
+    *new = *old;
+    init_waitqueue_head(&new->waitq);
+    new->epoll = NULL;
+    fd_map_set(newfd);
     pthread_mutex_unlock(&fd_lock);
-    return 0;
+    return newfd;
 }
 EXPORT_SYMBOL(dup2);
 
@@ -412,6 +590,7 @@ int mount(const char *path, void *dev,
         {
             mnt->path = strdup(path);
             mnt->open = open;
+            mnt->remove = NULL;
             mnt->dev = dev;
             return 0;
         }
@@ -421,6 +600,24 @@ int mount(const char *path, void *dev,
     return -1;
 }
 
+/* Let remove() of paths below <path> go to the mounted filesystem. */
+void mount_set_remove(const char *path,
+                      int (*remove)(struct mount_point *, const char *))
+{
+    unsigned int m;
+    struct mount_point *mnt;
+
+    for ( m = 0; m < ARRAY_SIZE(mount_points); m++ )
+    {
+        mnt = mount_points + m;
+        if ( mnt->path && !strcmp(mnt->path, path) )
+        {
+            mnt->remove = remove;
+            return;
+        }
+    }
+}
+
 void umount(const char *path)
 {
     unsigned int m;
@@ -440,7 +637,9 @@ void umount(const char *path)
 
 int isatty(int fd)
 {
-    return files[fd].type == FTYPE_CONSOLE;
+    struct file *file = get_file_from_fd(fd);
+
+    return file && file->type == FTYPE_CONSOLE;
 }
 EXPORT_SYMBOL(isatty);
 
@@ -482,6 +681,162 @@ int write(int fd, const void *buf, size_t nbytes)
 }
 EXPORT_SYMBOL(write);
 
+/*
+ * Vectored I/O for types without readv/writev ops, one read or write per
+ * buffer.  A position other than the file offset is applied by changing
+ * file->offset during the call, so this isn't safe against concurrent
+ * users of the file.
+ */
+static int file_rwv_emulate(struct file *file, const struct file_ops *ops,
+                            const struct iovec *iov, int iovcnt, off_t *pos,
+                            bool write)
+{
+    off_t orig = file->offset;
+    bool seek = pos != &file->offset;
+    int i, n, ret = 0;
+
+    if ( write ? !ops->write : !ops->read )
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    if ( seek )
+        file->offset = *pos;
+
+    for ( i = 0; i < iovcnt; i++ )
+    {
+        if ( write )
+            n = ops->write(file, iov[i].iov_base, iov[i].iov_len);
+        else
+            n = ops->read(file, iov[i].iov_base, iov[i].iov_len);
+        if ( n < 0 )
+        {
+            if ( !i )
+                ret = -1;
+            break;
+        }
+        ret += n;
+        if ( n < iov[i].iov_len )
+            break;
+    }
+
+    if ( seek )
+    {
+        *pos = file->offset;
+        file->offset = orig;
+    }
+
+    return ret;
+}
+
+/* pos is NULL for the file offset. */
+static ssize_t file_rwv_file(struct file *file, const struct iovec *iov,
+                             int iovcnt, off_t *pos, bool write)
+{
+    const struct file_ops *ops;
+    size_t total = 0;
+    int i;
+
+    if ( iovcnt < 0 || iovcnt > IOV_MAX )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    /* The ops return an int. */
+    for ( i = 0; i < iovcnt; i++ )
+    {
+        if ( iov[i].iov_len > INT_MAX - total )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        total += iov[i].iov_len;
+    }
+
+    ops = get_file_ops(file->type);
+    if ( pos && !ops->lseek )
+    {
+        errno = ESPIPE;
+        return -1;
+    }
+    if ( !pos )
+        pos = &file->offset;
+
+    if ( write && ops->writev )
+        return ops->writev(file, iov, iovcnt, pos);
+    if ( !write && ops->readv )
+        return ops->readv(file, iov, iovcnt, pos);
+
+    return file_rwv_emulate(file, ops, iov, iovcnt, pos, write);
+}
+
+static ssize_t file_rwv(int fd, const struct iovec *iov, int iovcnt,
+                        off_t *pos, bool write)
+{
+    struct file *file = get_file_from_fd(fd);
+
+    if ( !file )
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return file_rwv_file(file, iov, iovcnt, pos, write);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    return file_rwv(fd, iov, iovcnt, NULL, false);
+}
+EXPORT_SYMBOL(readv);
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    return file_rwv(fd, iov, iovcnt, NULL, true);
+}
+EXPORT_SYMBOL(writev);
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    if ( offset < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return file_rwv(fd, iov, iovcnt, &offset, false);
+}
+EXPORT_SYMBOL(preadv);
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    if ( offset < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return file_rwv(fd, iov, iovcnt, &offset, true);
+}
+EXPORT_SYMBOL(pwritev);
+
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = nbytes };
+
+    return preadv(fd, &iov, 1, offset);
+}
+EXPORT_SYMBOL(pread);
+
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = nbytes };
+
+    return pwritev(fd, &iov, 1, offset);
+}
+EXPORT_SYMBOL(pwrite);
+
 off_t lseek_default(struct file *file, off_t offset, int whence)
 {
     switch ( whence )
@@ -499,7 +854,7 @@ off_t lseek_default(struct file *file, off_t offset, int whence)
         struct stat st;
         int ret;
 
-        ret = fstat(file - files, &st);
+        ret = fstat(fd_of_file(file), &st);
         if ( ret )
             return -1;
         file->offset = st.st_size + offset;
@@ -536,12 +891,28 @@ off_t lseek(int fd, off_t offset, int whence)
 EXPORT_SYMBOL(lseek);
 EXPORT_SYMBOL(lseek64);
 
-int fsync(int fd) {
-    errno = EBADF;
+int fsync(int fd)
+{
+    struct file *file = get_file_from_fd(fd);
+    const struct file_ops *ops;
+
+    if ( !file )
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    ops = get_file_ops(file->type);
+    if ( ops->fsync )
+        return ops->fsync(file);
+
+    errno = EINVAL;
     return -1;
 }
 EXPORT_SYMBOL(fsync);
 
+static bool file_map_keep(struct file *file);
+
 int close(int fd)
 {
     int res = 0;
@@ -553,13 +924,18 @@ int close(int fd)
 
     ops = get_file_ops(file->type);
     printk("close(%d)\n", fd);
-    if ( ops->close )
+    while ( file->epoll )
+        epoll_remove(file->epoll);
+    if ( file_map_keep(file) )
+        ;   /* Closed by munmap() of its last mapping. */
+    else if ( ops->close )
         res = ops->close(file);
     else if ( file->type == FTYPE_NONE )
         goto error;
 
-    memset(files + fd, 0, sizeof(struct file));
+    memset(file, 0, sizeof(struct file));
     BUILD_BUG_ON(FTYPE_NONE != 0);
+    fd_map_clear(fd);
 
     return res;
 
@@ -619,6 +995,20 @@ EXPORT_SYMBOL(ftruncate);
 
 int remove(const char *pathname)
 {
+    unsigned int m, mlen;
+    struct mount_point *mnt;
+
+    for ( m = 0; m < ARRAY_SIZE(mount_points); m++ )
+    {
+        mnt = mount_points + m;
+        if ( !mnt->path || !mnt->remove )
+            continue;
+        mlen = strlen(mnt->path);
+        if ( !strncmp(pathname, mnt->path, mlen) &&
+             (pathname[mlen] == '/' || pathname[mlen] == 0) )
+            return mnt->remove(mnt, pathname + mlen);
+    }
+
     errno = EIO;
     return -1;
 }
@@ -650,7 +1040,7 @@ int fcntl(int fd, int cmd, ...)
         return -1;
     }
 
-    ops = get_file_ops(files[fd].type);
+    ops = get_file_ops(file->type);
 
     if ( ops->fcntl )
     {
@@ -671,32 +1061,94 @@ int fcntl(int fd, int cmd, ...)
 }
 EXPORT_SYMBOL(fcntl);
 
+/*
+ * Paths which can't be opened, or whose type can't list entries, give an
+ * empty directory, as they always did before readdir support.
+ */
 DIR *opendir(const char *name)
 {
     DIR *ret;
+    struct file *file;
+    int fd;
+
+    fd = open(name, O_RDONLY);
+    file = get_file_from_fd(fd);
+    if ( file && !get_file_ops(file->type)->readdir )
+    {
+        close(fd);
+        fd = -1;
+    }
+
     ret = malloc(sizeof(*ret));
     ret->name = strdup(name);
-    ret->offset = 0;
+    ret->fd = fd;
     ret->entries = NULL;
     ret->curentry = -1;
     ret->nbentries = 0;
-    ret->has_more = 1;
+    ret->has_more = fd >= 0;
     return ret;
 }
 EXPORT_SYMBOL(opendir);
 
+static void free_dir_entries(DIR *dir)
+{
+    int i;
+
+    for ( i = 0; i < dir->nbentries; i++ )
+        free(dir->entries[i]);
+    free(dir->entries);
+    dir->entries = NULL;
+    dir->nbentries = 0;
+    dir->curentry = -1;
+}
+
 struct dirent *readdir(DIR *dir)
 {
-    return NULL;
-} 
+    struct file *file;
+    const struct file_ops *ops;
+
+    if ( dir->curentry + 1 >= dir->nbentries )
+    {
+        free_dir_entries(dir);
+        if ( !dir->has_more )
+            return NULL;
+
+        file = get_file_from_fd(dir->fd);
+        if ( !file )
+        {
+            errno = EBADF;
+            return NULL;
+        }
+
+        ops = get_file_ops(file->type);
+        if ( !ops->readdir )
+        {
+            errno = ENOTDIR;
+            return NULL;
+        }
+
+        dir->nbentries = ops->readdir(file, &dir->entries);
+        if ( dir->nbentries <= 0 )
+        {
+            dir->nbentries = 0;
+            dir->entries = NULL;
+            dir->has_more = 0;
+            return NULL;
+        }
+    }
+
+    dir->curentry++;
+    dir->dirent.d_name = dir->entries[dir->curentry];
+
+    return &dir->dirent;
+}
 EXPORT_SYMBOL(readdir);
 
 int closedir(DIR *dir)
 {
-    int i;
-    for (i=0; i<dir->nbentries; i++)
-        free(dir->entries[i]);
-    free(dir->entries);
+    free_dir_entries(dir);
+    if ( dir->fd >= 0 )
+        close(dir->fd);
     free(dir->name);
     free(dir);
     return 0;
@@ -715,7 +1167,7 @@ static void dump_set(int nfds, fd_set *readfds, fd_set *writefds, fd_set *except
 	if (FD_ISSET(i, set)) { \
 	    if (comma) \
 		printk(", "); \
-            printk("%d(%s)", i, get_file_ops(files[i].type)->name); \
+            printk("%d(%s)", i, get_file_ops(fd_slot(i)->type)->name); \
 	    comma = 1; \
 	} \
     } \
@@ -749,7 +1201,7 @@ static void dump_pollfds(struct pollfd *pfd, int nfds, int timeout)
         fd = pfd[i].fd;
         if (comma)
             printk(", ");
-        printk("%d(%s)/%02x", fd, get_file_ops(files[fd].type)->name,
+        printk("%d(%s)/%02x", fd, get_file_ops(fd_slot(fd)->type)->name,
             pfd[i].events);
             comma = 1;
     }
@@ -768,10 +1220,37 @@ bool select_yes(struct file *file)
 
 bool select_read_flag(struct file *file)
 {
-    return file->read;
+    return file->read || (file->events & POLLIN);
 }
 EXPORT_SYMBOL(select_read_flag);
 
+/*
+ * Mark events as maybe available on file and wake up only the waiters of
+ * that file.  Callable from interrupt handlers.
+ */
+void file_set_events(struct file *file, uint32_t events)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    file->events |= events;
+    local_irq_restore(flags);
+
+    wake_up(&file->waitq);
+    file_notify(file);
+}
+EXPORT_SYMBOL(file_set_events);
+
+void file_clear_events(struct file *file, uint32_t events)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    file->events &= ~events;
+    local_irq_restore(flags);
+}
+EXPORT_SYMBOL(file_clear_events);
+
 /* Just poll without blocking */
 static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
 {
@@ -784,7 +1263,7 @@ static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exce
 
 #ifdef LIBC_VERBOSE
     static int nb;
-    static int nbread[NOFILE], nbwrite[NOFILE], nbexcept[NOFILE];
+    static int nbread[FD_SETSIZE], nbwrite[FD_SETSIZE], nbexcept[FD_SETSIZE];
     static s_time_t lastshown;
 
     nb++;
@@ -796,17 +1275,19 @@ static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exce
     FD_ZERO(&sock_writefds);
     FD_ZERO(&sock_exceptfds);
     for (i = 0; i < nfds; i++) {
-	if (files[i].type == FTYPE_SOCKET) {
+	struct file *file = get_file_from_fd(i);
+
+	if (file && file->type == FTYPE_SOCKET) {
 	    if (FD_ISSET(i, readfds)) {
-		FD_SET(files[i].fd, &sock_readfds);
+		FD_SET(file->fd, &sock_readfds);
 		sock_nfds = i+1;
 	    }
 	    if (FD_ISSET(i, writefds)) {
-		FD_SET(files[i].fd, &sock_writefds);
+		FD_SET(file->fd, &sock_writefds);
 		sock_nfds = i+1;
 	    }
 	    if (FD_ISSET(i, exceptfds)) {
-		FD_SET(files[i].fd, &sock_exceptfds);
+		FD_SET(file->fd, &sock_exceptfds);
 		sock_nfds = i+1;
 	    }
 	}
@@ -876,19 +1357,19 @@ static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exce
 	case FTYPE_SOCKET:
 	    if (FD_ISSET(i, readfds)) {
 	        /* Optimize no-network-packet case.  */
-		if (sock_n && FD_ISSET(files[i].fd, &sock_readfds))
+		if (sock_n && FD_ISSET(file->fd, &sock_readfds))
 		    n++;
 		else
 		    FD_CLR(i, readfds);
 	    }
             if (FD_ISSET(i, writefds)) {
-		if (sock_n && FD_ISSET(files[i].fd, &sock_writefds))
+		if (sock_n && FD_ISSET(file->fd, &sock_writefds))
 		    n++;
 		else
 		    FD_CLR(i, writefds);
             }
             if (FD_ISSET(i, exceptfds)) {
-		if (sock_n && FD_ISSET(files[i].fd, &sock_exceptfds))
+		if (sock_n && FD_ISSET(file->fd, &sock_exceptfds))
 		    n++;
 		else
 		    FD_CLR(i, exceptfds);
@@ -912,7 +1393,7 @@ static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exce
 	printk("%d(%d): ", nb, sock_n);
 	for (i = 0; i < nfds; i++) {
 	    if (nbread[i] || nbwrite[i] || nbexcept[i])
-                printk(" %d(%c):", i, get_file_ops(files[i].type)->name);
+                printk(" %d(%c):", i, get_file_ops(fd_slot(i)->type)->name);
 	    if (nbread[i])
 	    	printk(" %dR", nbread[i]);
 	    if (nbwrite[i])
@@ -930,6 +1411,110 @@ static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exce
     return n;
 }
 
+/* Waiters on all the queues signalling readiness of some file. */
+struct select_waiters {
+#ifdef CONFIG_NETFRONT
+    struct wait_queue netfront_w;
+#endif
+    struct wait_queue event_w;
+#ifdef CONFIG_BLKFRONT
+    struct wait_queue blkfront_w;
+#endif
+#ifdef CONFIG_XENBUS
+    struct wait_queue xenbus_watch_w;
+#endif
+#ifdef CONFIG_KBDFRONT
+    struct wait_queue kbdfront_w;
+#endif
+    struct wait_queue console_w;
+};
+
+static void select_add_waiters(struct select_waiters *w)
+{
+    struct thread *thread = get_current();
+
+#ifdef CONFIG_NETFRONT
+    init_waitqueue_entry(&w->netfront_w, thread);
+    add_waiter(w->netfront_w, netfront_queue);
+#endif
+    init_waitqueue_entry(&w->event_w, thread);
+    add_waiter(w->event_w, event_queue);
+#ifdef CONFIG_BLKFRONT
+    init_waitqueue_entry(&w->blkfront_w, thread);
+    add_waiter(w->blkfront_w, blkfront_queue);
+#endif
+#ifdef CONFIG_XENBUS
+    init_waitqueue_entry(&w->xenbus_watch_w, thread);
+    add_waiter(w->xenbus_watch_w, xenbus_watch_queue);
+#endif
+#ifdef CONFIG_KBDFRONT
+    init_waitqueue_entry(&w->kbdfront_w, thread);
+    add_waiter(w->kbdfront_w, kbdfront_queue);
+#endif
+    init_waitqueue_entry(&w->console_w, thread);
+    add_waiter(w->console_w, console_queue);
+}
+
+static void select_remove_waiters(struct select_waiters *w)
+{
+#ifdef CONFIG_NETFRONT
+    remove_waiter(w->netfront_w, netfront_queue);
+#endif
+    remove_waiter(w->event_w, event_queue);
+#ifdef CONFIG_BLKFRONT
+    remove_waiter(w->blkfront_w, blkfront_queue);
+#endif
+#ifdef CONFIG_XENBUS
+    remove_waiter(w->xenbus_watch_w, xenbus_watch_queue);
+#endif
+#ifdef CONFIG_KBDFRONT
+    remove_waiter(w->kbdfront_w, kbdfront_queue);
+#endif
+    remove_waiter(w->console_w, console_queue);
+}
+
+/*
+ * Wait on the queues of the files in the sets which use file_set_events().
+ * Return whether there are other files, which are only signalled via the
+ * global queues.
+ */
+static bool select_add_file_waiters(int nfds, fd_set *readfds,
+                                    fd_set *writefds, fd_set *exceptfds,
+                                    struct wait_queue *w)
+{
+    struct thread *thread = get_current();
+    struct file *file;
+    bool global = false;
+    int i;
+
+    for ( i = 0; i < nfds; i++ )
+    {
+        init_waitqueue_entry(w + i, thread);
+        if ( !FD_ISSET(i, readfds) && !FD_ISSET(i, writefds) &&
+             !FD_ISSET(i, exceptfds) )
+            continue;
+
+        file = get_file_from_fd(i);
+        if ( !file )
+            continue;
+        if ( get_file_ops(file->type)->notify )
+            add_waiter(w[i], file->waitq);
+        else
+            global = true;
+    }
+
+    return global;
+}
+
+static void select_remove_file_waiters(int nfds, struct wait_queue *w)
+{
+    int i;
+
+    for ( i = 0; i < nfds; i++ )
+        if ( w[i].waiting )
+            remove_waiter(w[i], fd_slot(i)->waitq);
+}
+
 /* The strategy is to
  * - announce that we will maybe sleep
  * - poll a bit ; if successful, return
@@ -942,20 +1527,10 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
     fd_set myread, mywrite, myexcept;
     struct thread *thread = get_current();
     s_time_t start = NOW(), stop;
-#ifdef CONFIG_NETFRONT
-    DEFINE_WAIT(netfront_w);
-#endif
-    DEFINE_WAIT(event_w);
-#ifdef CONFIG_BLKFRONT
-    DEFINE_WAIT(blkfront_w);
-#endif
-#ifdef CONFIG_XENBUS
-    DEFINE_WAIT(xenbus_watch_w);
-#endif
-#ifdef CONFIG_KBDFRONT
-    DEFINE_WAIT(kbdfront_w);
-#endif
-    DEFINE_WAIT(console_w);
+    struct select_waiters waiters;
+    struct wait_queue file_w[FD_SETSIZE];
+    int nwait = nfds < FD_SETSIZE ? nfds : FD_SETSIZE;
+    bool global;
 
     assert(thread == main_thread);
 
@@ -969,24 +1544,6 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
 	/* just make gcc happy */
 	stop = start;
 
-    /* Tell people we're going to sleep before looking at what they are
-     * saying, hence letting them wake us if events happen between here and
-     * schedule() */
-#ifdef CONFIG_NETFRONT
-    add_waiter(netfront_w, netfront_queue);
-#endif
-    add_waiter(event_w, event_queue);
-#ifdef CONFIG_BLKFRONT
-    add_waiter(blkfront_w, blkfront_queue);
-#endif
-#ifdef CONFIG_XENBUS
-    add_waiter(xenbus_watch_w, xenbus_watch_queue);
-#endif
-#ifdef CONFIG_KBDFRONT
-    add_waiter(kbdfront_w, kbdfront_queue);
-#endif
-    add_waiter(console_w, console_queue);
-
     if (readfds)
         myread = *readfds;
     else
@@ -1000,6 +1557,14 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
     else
         FD_ZERO(&myexcept);
 
+    /* Tell people we're going to sleep before looking at what they are
+     * saying, hence letting them wake us if events happen between here and
+     * schedule() */
+    global = select_add_file_waiters(nwait, &myread, &mywrite, &myexcept,
+                                     file_w);
+    if (global)
+        select_add_waiters(&waiters);
+
     DEBUG("polling ");
     dump_set(nfds, &myread, &mywrite, &myexcept, timeout);
     DEBUG("\n");
@@ -1067,116 +1632,595 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
     ret = -1;
 
 out:
-#ifdef CONFIG_NETFRONT
-    remove_waiter(netfront_w, netfront_queue);
-#endif
-    remove_waiter(event_w, event_queue);
-#ifdef CONFIG_BLKFRONT
-    remove_waiter(blkfront_w, blkfront_queue);
+    select_remove_file_waiters(nwait, file_w);
+    if (global)
+        select_remove_waiters(&waiters);
+    return ret;
+}
+EXPORT_SYMBOL(select);
+
+/*
+ * Poll the entries without blocking and set their revents, return the
+ * number of entries with revents set.  Unlike select() this is not limited
+ * by FD_SETSIZE, except for the lwIP socket numbers.
+ */
+static int poll_check(struct pollfd *pfd, nfds_t nfds)
+{
+    const struct file_ops *ops;
+    struct file *file;
+    nfds_t i;
+    int n = 0;
+#ifdef HAVE_LWIP
+    fd_set rd, wr, ex;
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 0 };
+    int sock_nfds = 0;
+
+    FD_ZERO(&rd);
+    FD_ZERO(&wr);
+    FD_ZERO(&ex);
 #endif
-#ifdef CONFIG_XENBUS
-    remove_waiter(xenbus_watch_w, xenbus_watch_queue);
+
+    for ( i = 0; i < nfds; i++ )
+    {
+        pfd[i].revents = 0;
+
+        /* fd < 0, revents = 0 */
+        if ( pfd[i].fd < 0 )
+            continue;
+
+        file = get_file_from_fd(pfd[i].fd);
+        if ( !file )
+        {
+            pfd[i].revents = POLLNVAL;
+            n++;
+            continue;
+        }
+
+#ifdef HAVE_LWIP
+        if ( file->type == FTYPE_SOCKET )
+        {
+            if ( file->fd >= FD_SETSIZE )
+            {
+                pfd[i].revents = POLLNVAL;
+                n++;
+                continue;
+            }
+            if ( pfd[i].events & POLLIN )
+                FD_SET(file->fd, &rd);
+            if ( pfd[i].events & POLLOUT )
+                FD_SET(file->fd, &wr);
+            FD_SET(file->fd, &ex);
+            if ( file->fd >= sock_nfds )
+                sock_nfds = file->fd + 1;
+            continue;
+        }
 #endif
-#ifdef CONFIG_KBDFRONT
-    remove_waiter(kbdfront_w, kbdfront_queue);
+
+        ops = get_file_ops(file->type);
+        if ( (pfd[i].events & POLLIN) && ops->select_rd &&
+             ops->select_rd(file) )
+            pfd[i].revents |= POLLIN;
+        if ( (pfd[i].events & POLLOUT) && ops->select_wr &&
+             ops->select_wr(file) )
+            pfd[i].revents |= POLLOUT;
+        if ( pfd[i].revents )
+            n++;
+    }
+
+#ifdef HAVE_LWIP
+    /* All sockets at once. */
+    if ( !sock_nfds ||
+         lwip_select(sock_nfds, &rd, &wr, &ex, &timeout) <= 0 )
+        return n;
+
+    for ( i = 0; i < nfds; i++ )
+    {
+        file = get_file_from_fd(pfd[i].fd);
+        if ( !file || file->type != FTYPE_SOCKET || pfd[i].revents )
+            continue;
+
+        if ( FD_ISSET(file->fd, &ex) )
+            pfd[i].revents = POLLERR;
+        else
+        {
+            if ( FD_ISSET(file->fd, &rd) )
+                pfd[i].revents |= POLLIN;
+            if ( FD_ISSET(file->fd, &wr) )
+                pfd[i].revents |= POLLOUT;
+        }
+        if ( pfd[i].revents )
+            n++;
+    }
 #endif
-    remove_waiter(console_w, console_queue);
-    return ret;
+
+    return n;
+}
+
+/* Same as select_add_file_waiters(), for a pollfd array. */
+static bool poll_add_waiters(struct pollfd *pfd, nfds_t nfds,
+                             struct wait_queue *w)
+{
+    struct thread *thread = get_current();
+    struct file *file;
+    bool global = false;
+    nfds_t i;
+
+    for ( i = 0; i < nfds; i++ )
+    {
+        init_waitqueue_entry(w + i, thread);
+        file = get_file_from_fd(pfd[i].fd);
+        if ( !file )
+            continue;
+        if ( get_file_ops(file->type)->notify )
+            add_waiter(w[i], file->waitq);
+        else
+            global = true;
+    }
+
+    return global;
+}
+
+static void poll_remove_waiters(struct pollfd *pfd, nfds_t nfds,
+                                struct wait_queue *w)
+{
+    nfds_t i;
+
+    for ( i = 0; i < nfds; i++ )
+        if ( w[i].waiting )
+            remove_waiter(w[i], fd_slot(pfd[i].fd)->waitq);
 }
-EXPORT_SYMBOL(select);
 
-/* Wrap around select */
 int poll(struct pollfd _pfd[], nfds_t _nfds, int _timeout)
 {
-    int n, ret;
-    int i, fd;
-    struct timeval _timeo, *timeo = NULL;
-    fd_set rfds, wfds, efds;
-    int max_fd = -1;
+    struct thread *thread = get_current();
+    struct select_waiters waiters;
+    struct wait_queue stack_w[FD_SETSIZE], *w = stack_w;
+    s_time_t stop = 0;
+    bool global, done;
+    int n;
 
     DEBUG("poll(");
     dump_pollfds(_pfd, _nfds, _timeout);
     DEBUG(")\n");
 
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
+    if ( _nfds > ARRAY_SIZE(stack_w) )
+    {
+        w = malloc(_nfds * sizeof(*w));
+        if ( !w )
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    if ( _timeout > 0 )
+        stop = NOW() + MILLISECS(_timeout);
+
+    /* Same strategy as select(): announce the sleep, then look. */
+    do {
+        global = poll_add_waiters(_pfd, _nfds, w);
+        if ( global )
+            select_add_waiters(&waiters);
 
-    n = 0;
+        n = poll_check(_pfd, _nfds);
+        done = n || !_timeout || (_timeout > 0 && NOW() >= stop);
+        if ( done )
+            wake(thread);
+        else
+        {
+            if ( _timeout > 0 )
+                thread->wakeup_time = stop;
+            schedule();
+        }
 
-    for (i = 0; i < _nfds; i++) {
-        fd = _pfd[i].fd;
-        _pfd[i].revents = 0;
+        poll_remove_waiters(_pfd, _nfds, w);
+        if ( global )
+            select_remove_waiters(&waiters);
+    } while ( !done );
 
-        /* fd < 0, revents = 0, which is already set */
-        if (fd < 0) continue;
+    if ( w != stack_w )
+        free(w);
 
-        /* fd is invalid, revents = POLLNVAL, increment counter */
-        if (fd >= NOFILE || files[fd].type == FTYPE_NONE) {
-            n++;
-            _pfd[i].revents |= POLLNVAL;
+    return n;
+}
+EXPORT_SYMBOL(poll);
+
+/*
+ * epoll: files are registered once.  Files of types setting the notify
+ * flag in their file_ops queue their items on the ready list of the epoll
+ * instance via file_notify(), so epoll_wait() only looks at files which
+ * signalled a change.  Items of other types (sockets, console, ...) are
+ * polled through select_poll() on each epoll_wait(), waking up on the same
+ * global queues as select().
+ */
+struct epoll_item {
+    struct epoll *ep;
+    struct file *file;
+    int fd;
+    struct epoll_event event;
+    bool polled;                /* On ep->polled instead of ep->ready. */
+    bool ready;                 /* On ep->ready. */
+    struct epoll_item *file_next;   /* Next item watching the same file. */
+    MINIOS_TAILQ_ENTRY(struct epoll_item) items;
+    MINIOS_TAILQ_ENTRY(struct epoll_item) list;
+};
+
+MINIOS_TAILQ_HEAD(epoll_items, struct epoll_item);
+
+struct epoll {
+    struct epoll_items items;
+    struct epoll_items ready;
+    struct epoll_items polled;
+    struct wait_queue_head waitq;
+};
+
+/* Called with interrupts disabled. */
+static void epoll_queue(struct epoll_item *item)
+{
+    if ( item->ready || !item->event.events )
+        return;
+
+    item->ready = true;
+    MINIOS_TAILQ_INSERT_TAIL(&item->ep->ready, item, list);
+    wake_up(&item->ep->waitq);
+}
+
+/* Signal a possible readiness change of file, callable from interrupts. */
+void file_notify(struct file *file)
+{
+    struct epoll_item *item;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    for ( item = file->epoll; item; item = item->file_next )
+        epoll_queue(item);
+    local_irq_restore(flags);
+}
+EXPORT_SYMBOL(file_notify);
+
+static struct epoll_item *epoll_find(struct epoll *ep, struct file *file)
+{
+    struct epoll_item *item;
+
+    for ( item = file->epoll; item; item = item->file_next )
+        if ( item->ep == ep )
+            return item;
+
+    return NULL;
+}
+
+static void epoll_remove(struct epoll_item *item)
+{
+    struct epoll *ep = item->ep;
+    struct epoll_item **pprev;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    for ( pprev = &item->file->epoll; *pprev != item;
+          pprev = &(*pprev)->file_next );
+    *pprev = item->file_next;
+    MINIOS_TAILQ_REMOVE(&ep->items, item, items);
+    if ( item->polled )
+        MINIOS_TAILQ_REMOVE(&ep->polled, item, list);
+    else if ( item->ready )
+        MINIOS_TAILQ_REMOVE(&ep->ready, item, list);
+    local_irq_restore(flags);
+
+    free(item);
+}
+
+static uint32_t epoll_item_events(struct epoll_item *item)
+{
+    const struct file_ops *ops = get_file_ops(item->file->type);
+    uint32_t events = 0;
+
+    if ( (item->event.events & EPOLLIN) && ops->select_rd &&
+         ops->select_rd(item->file) )
+        events |= EPOLLIN;
+    if ( (item->event.events & EPOLLOUT) && ops->select_wr &&
+         ops->select_wr(item->file) )
+        events |= EPOLLOUT;
+
+    return events;
+}
+
+static void epoll_report(struct epoll_item *item, uint32_t events,
+                         struct epoll_event *event)
+{
+    event->events = events;
+    event->data = item->event.data;
+    if ( item->event.events & EPOLLONESHOT )
+        item->event.events = 0;
+}
+
+/*
+ * Poll the items of types without notification one by one, so socket
+ * numbers beyond FD_SETSIZE never reach an fd_set.
+ */
+static int epoll_collect_polled(struct epoll *ep, struct epoll_event *events,
+                                int maxevents)
+{
+    struct epoll_item *item;
+    struct pollfd pfd;
+    uint32_t revents;
+    int n = 0;
+
+    MINIOS_TAILQ_FOREACH(item, &ep->polled, list)
+    {
+        if ( n == maxevents )
+            break;
+        pfd.fd = item->fd;
+        pfd.events = 0;
+        if ( item->event.events & EPOLLIN )
+            pfd.events |= POLLIN;
+        if ( item->event.events & EPOLLOUT )
+            pfd.events |= POLLOUT;
+        if ( !pfd.events || !poll_check(&pfd, 1) )
             continue;
+
+        revents = 0;
+        if ( pfd.revents & POLLIN )
+            revents |= EPOLLIN;
+        if ( pfd.revents & POLLOUT )
+            revents |= EPOLLOUT;
+        if ( pfd.revents & (POLLERR | POLLNVAL) )
+            revents |= EPOLLERR;
+        epoll_report(item, revents, events + n++);
+    }
+
+    return n;
+}
+
+static int epoll_collect(struct epoll *ep, struct epoll_event *events,
+                         int maxevents)
+{
+    struct epoll_items again = MINIOS_TAILQ_HEAD_INITIALIZER(again);
+    struct epoll_item *item;
+    unsigned long flags;
+    uint32_t revents;
+    int n = 0;
+
+    /*
+     * Take items off the ready list before looking at them, so a
+     * notification arriving meanwhile queues them again.  Items still
+     * ready stay queued unless they are edge triggered.
+     */
+    local_irq_save(flags);
+    while ( n < maxevents && (item = MINIOS_TAILQ_FIRST(&ep->ready)) )
+    {
+        MINIOS_TAILQ_REMOVE(&ep->ready, item, list);
+        item->ready = false;
+        local_irq_restore(flags);
+
+        revents = epoll_item_events(item);
+        if ( revents )
+            epoll_report(item, revents, events + n++);
+
+        local_irq_save(flags);
+        if ( revents && !item->ready && item->event.events &&
+             !(item->event.events & EPOLLET) )
+        {
+            item->ready = true;
+            MINIOS_TAILQ_INSERT_TAIL(&again, item, list);
         }
+    }
+    while ( (item = MINIOS_TAILQ_FIRST(&again)) )
+    {
+        MINIOS_TAILQ_REMOVE(&again, item, list);
+        MINIOS_TAILQ_INSERT_TAIL(&ep->ready, item, list);
+    }
+    local_irq_restore(flags);
 
-        /* normal case, map POLL* into readfds and writefds:
-         * POLLIN  -> readfds
-         * POLLOUT -> writefds
-         * POLL*   -> none
-         */
-        if (_pfd[i].events & POLLIN)
-            FD_SET(fd, &rfds);
-        if (_pfd[i].events & POLLOUT)
-            FD_SET(fd, &wfds);
-        /* always set exceptfds */
-        FD_SET(fd, &efds);
-        if (fd > max_fd)
-            max_fd = fd;
-    }
-
-    /* should never sleep when we already have events */
-    if (n) {
-        _timeo.tv_sec  = 0;
-        _timeo.tv_usec = 0;
-        timeo = &_timeo;
-    } else if (_timeout >= 0) {
-        /* normal case, construct _timeout, might sleep */
-        _timeo.tv_sec  = _timeout / 1000;
-        _timeo.tv_usec = (_timeout % 1000) * 1000;
-        timeo = &_timeo;
-    } else {
-        /* _timeout < 0, block forever */
-        timeo = NULL;
-    }
-
-
-    ret = select(max_fd+1, &rfds, &wfds, &efds, timeo);
-    /* error in select, just return, errno is set by select() */
-    if (ret < 0)
-        return ret;
-
-    for (i = 0; i < _nfds; i++) {
-        fd = _pfd[i].fd;
-
-        /* the revents has already been set for all error case */
-        if (fd < 0 || fd >= NOFILE || files[fd].type == FTYPE_NONE)
-            continue;
+    if ( n < maxevents && !MINIOS_TAILQ_EMPTY(&ep->polled) )
+        n += epoll_collect_polled(ep, events + n, maxevents - n);
 
-        if (FD_ISSET(fd, &rfds) || FD_ISSET(fd, &wfds) || FD_ISSET(fd, &efds))
-            n++;
-        if (FD_ISSET(fd, &efds)) {
-            /* anything bad happens we set POLLERR */
-            _pfd[i].revents |= POLLERR;
-            continue;
+    return n;
+}
+
+static int epoll_close_fd(struct file *file)
+{
+    struct epoll *ep = file->dev;
+    struct epoll_item *item;
+
+    while ( (item = MINIOS_TAILQ_FIRST(&ep->items)) )
+        epoll_remove(item);
+    free(ep);
+
+    return 0;
+}
+
+static bool epoll_select_rd(struct file *file)
+{
+    struct epoll *ep = file->dev;
+
+    return !MINIOS_TAILQ_EMPTY(&ep->ready);
+}
+
+static const struct file_ops epoll_ops = {
+    .name = "epoll",
+    .close = epoll_close_fd,
+    .select_rd = epoll_select_rd,
+};
+
+int epoll_create1(int flags)
+{
+    struct epoll *ep;
+    int fd;
+
+    if ( flags & ~EPOLL_CLOEXEC )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ep = malloc(sizeof(*ep));
+    if ( !ep )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    MINIOS_TAILQ_INIT(&ep->items);
+    MINIOS_TAILQ_INIT(&ep->ready);
+    MINIOS_TAILQ_INIT(&ep->polled);
+    init_waitqueue_head(&ep->waitq);
+
+    fd = alloc_fd(FTYPE_EPOLL);
+    get_file_from_fd(fd)->dev = ep;
+
+    return fd;
+}
+EXPORT_SYMBOL(epoll_create1);
+
+int epoll_create(int size)
+{
+    if ( size <= 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return epoll_create1(0);
+}
+EXPORT_SYMBOL(epoll_create);
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    struct file *epfile = get_file_from_fd(epfd);
+    struct file *file = get_file_from_fd(fd);
+    struct epoll_item *item;
+    struct epoll *ep;
+    unsigned long flags;
+
+    if ( !epfile || epfile->type != FTYPE_EPOLL || !file )
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if ( file == epfile )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ep = epfile->dev;
+    item = epoll_find(ep, file);
+
+    switch ( op )
+    {
+    case EPOLL_CTL_ADD:
+        if ( item )
+        {
+            errno = EEXIST;
+            return -1;
+        }
+        item = malloc(sizeof(*item));
+        if ( !item )
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        item->ep = ep;
+        item->file = file;
+        item->fd = fd;
+        item->event = *event;
+        item->polled = !get_file_ops(file->type)->notify;
+        item->ready = false;
+
+        local_irq_save(flags);
+        item->file_next = file->epoll;
+        file->epoll = item;
+        MINIOS_TAILQ_INSERT_TAIL(&ep->items, item, items);
+        if ( item->polled )
+            MINIOS_TAILQ_INSERT_TAIL(&ep->polled, item, list);
+        else
+            epoll_queue(item);
+        local_irq_restore(flags);
+        break;
+
+    case EPOLL_CTL_MOD:
+        if ( !item )
+        {
+            errno = ENOENT;
+            return -1;
+        }
+        local_irq_save(flags);
+        item->event = *event;
+        if ( !item->polled )
+            epoll_queue(item);
+        local_irq_restore(flags);
+        break;
+
+    case EPOLL_CTL_DEL:
+        if ( !item )
+        {
+            errno = ENOENT;
+            return -1;
         }
-        if (FD_ISSET(fd, &rfds))
-            _pfd[i].revents |= POLLIN;
-        if (FD_ISSET(fd, &wfds))
-            _pfd[i].revents |= POLLOUT;
+        epoll_remove(item);
+        break;
+
+    default:
+        errno = EINVAL;
+        return -1;
     }
 
+    return 0;
+}
+EXPORT_SYMBOL(epoll_ctl);
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout)
+{
+    struct file *file = get_file_from_fd(epfd);
+    struct thread *thread = get_current();
+    struct select_waiters waiters;
+    struct epoll *ep;
+    s_time_t stop = 0;
+    bool polled, done;
+    int n;
+    DEFINE_WAIT(w);
+
+    if ( !file || file->type != FTYPE_EPOLL )
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if ( maxevents <= 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ep = file->dev;
+    if ( timeout > 0 )
+        stop = NOW() + MILLISECS(timeout);
+
+    /* Same strategy as select(): announce the sleep, then look. */
+    do {
+        polled = !MINIOS_TAILQ_EMPTY(&ep->polled);
+        add_waiter(w, ep->waitq);
+        if ( polled )
+            select_add_waiters(&waiters);
+
+        n = epoll_collect(ep, events, maxevents);
+        done = n || !timeout || (timeout > 0 && NOW() >= stop);
+        if ( done )
+            wake(thread);
+        else
+        {
+            if ( timeout > 0 )
+                thread->wakeup_time = stop;
+            schedule();
+        }
+
+        remove_waiter(w, ep->waitq);
+        if ( polled )
+            select_remove_waiters(&waiters);
+    } while ( !done );
+
     return n;
 }
-EXPORT_SYMBOL(poll);
+EXPORT_SYMBOL(epoll_wait);
 
 #ifdef HAVE_LWIP
 int socket(int domain, int type, int protocol)
@@ -1187,24 +2231,25 @@ int socket(int domain, int type, int protocol)
 	return -1;
     res = alloc_fd(FTYPE_SOCKET);
     printk("socket -> %d\n", res);
-    files[res].fd = fd;
+    get_file_from_fd(res)->fd = fd;
     return res;
 }
 EXPORT_SYMBOL(socket);
 
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
+    struct file *file = get_file_from_fd(s);
     int fd, res;
-    if (files[s].type != FTYPE_SOCKET) {
+    if (!file || file->type != FTYPE_SOCKET) {
 	printk("accept(%d): Bad descriptor\n", s);
 	errno = EBADF;
 	return -1;
     }
-    fd = lwip_accept(files[s].fd, addr, addrlen);
+    fd = lwip_accept(file->fd, addr, addrlen);
     if (fd < 0)
 	return -1;
     res = alloc_fd(FTYPE_SOCKET);
-    files[res].fd = fd;
+    get_file_from_fd(res)->fd = fd;
     printk("accepted on %d -> %d\n", s, res);
     return res;
 }
@@ -1213,12 +2258,13 @@ EXPORT_SYMBOL(accept);
 #define LWIP_STUB(ret, name, proto, args) \
 ret name proto \
 { \
-    if (files[s].type != FTYPE_SOCKET) { \
+    struct file *file = get_file_from_fd(s); \
+    if (!file || file->type != FTYPE_SOCKET) { \
 	printk(#name "(%d): Bad descriptor\n", s); \
 	errno = EBADF; \
 	return -1; \
     } \
-    s = files[s].fd; \
+    s = file->fd; \
     return lwip_##name args; \
 }
 
@@ -1403,33 +2449,31 @@ EXPORT_SYMBOL(sleep);
 
 int clock_gettime(clockid_t clk_id, struct timespec *tp)
 {
+    uint64_t nsec;
+
     switch (clk_id) {
 	case CLOCK_MONOTONIC:
-	{
-	    struct timeval tv;
-
-	    gettimeofday(&tv, NULL);
-
-	    tp->tv_sec = tv.tv_sec;
-	    tp->tv_nsec = tv.tv_usec * 1000;
-
+	case CLOCK_MONOTONIC_RAW:
+	    nsec = monotonic_clock();
+	    break;
+	case CLOCK_MONOTONIC_COARSE:
+	    nsec = monotonic_clock_coarse();
 	    break;
-	}
 	case CLOCK_REALTIME:
-	{
-	    uint64_t nsec = monotonic_clock();
-
-	    tp->tv_sec = nsec / 1000000000ULL;
-	    tp->tv_nsec = nsec % 1000000000ULL;
-
+	    nsec = wallclock_base() + monotonic_clock();
+	    break;
+	case CLOCK_REALTIME_COARSE:
+	    nsec = wallclock_base() + monotonic_clock_coarse();
 	    break;
-	}
 	default:
 	    print_unsupported("clock_gettime(%ld)", (long) clk_id);
 	    errno = EINVAL;
 	    return -1;
     }
 
+    tp->tv_sec = nsec / 1000000000ULL;
+    tp->tv_nsec = nsec % 1000000000ULL;
+
     return 0;
 }
 EXPORT_SYMBOL(clock_gettime);
@@ -1471,30 +2515,382 @@ size_t getpagesize(void)
 }
 EXPORT_SYMBOL(getpagesize);
 
+/*
+ * File backed mappings.  Their pages are reserved in the demand area but
+ * left unmapped, so that the first access faults into mmap_fault(), which
+ * reads the page from the file.  Writable shared pages are first mapped
+ * read-only, the first write faults again and marks the page dirty for
+ * msync() and munmap() to write back.  Mappings are neither coherent with
+ * read() and write() on the file nor with each other.
+ */
+struct file_map {
+    struct file_map *next;
+    unsigned long va;
+    unsigned long n;            /* Number of pages. */
+    unsigned long gen;          /* Tells a mapping apart from later ones. */
+    struct file *file;          /* fd slot, own copy once fd closed, NULL. */
+    bool own_file;
+    int prot;
+    int flags;
+    off_t offset;
+    off_t size;                 /* File size if a read hit its end, or -1. */
+    unsigned long pages[];      /* Backing page or 0, | FILE_MAP_DIRTY. */
+};
+
+#define FILE_MAP_DIRTY  1UL
+
+static struct file_map *file_maps;
+static unsigned long file_map_gen;
+
+static struct file_map *file_map_find(unsigned long va)
+{
+    struct file_map *m;
+
+    for ( m = file_maps; m; m = m->next )
+        if ( va >= m->va && va - m->va < m->n * PAGE_SIZE )
+            return m;
+
+    return NULL;
+}
+
+/* Look the mapping up again after blocking, as it may have gone meanwhile. */
+static struct file_map *file_map_recheck(unsigned long va, unsigned long gen)
+{
+    struct file_map *m = file_map_find(va);
+
+    return (m && m->gen == gen) ? m : NULL;
+}
+
+static ssize_t file_map_rw(struct file_map *m, void *buf, size_t len,
+                           off_t pos, bool write)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    if ( !m->file )
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return file_rwv_file(m->file, &iov, 1, &pos, write);
+}
+
+static unsigned long file_map_prot(struct file_map *m, unsigned long i)
+{
+    if ( !(m->prot & PROT_WRITE) )
+        return L1_PROT_RO;
+    if ( (m->flags & MAP_SHARED) && !(m->pages[i] & FILE_MAP_DIRTY) )
+        return L1_PROT_RO;
+    return L1_PROT;
+}
+
+int mmap_fault(struct pt_regs *regs, unsigned long addr, bool write)
+{
+    struct file_map *m = file_map_find(addr);
+    unsigned long i, page, gen, flags;
+    off_t pos;
+    ssize_t ret;
+
+    /*
+     * Reading the page blocks, which is only possible if the faulting
+     * context could block.  Look at its flags rather than at the current
+     * ones: on PVH the fault is taken through an interrupt gate.
+     */
+    if ( !m || !(regs->eflags & X86_EFLAGS_IF) )
+        return 0;
+    if ( write && !(m->prot & PROT_WRITE) )
+        return 0;
+
+    i = (addr - m->va) >> PAGE_SHIFT;
+    if ( !m->pages[i] )
+    {
+        page = alloc_page();
+        if ( !page )
+            return 0;
+        pos = m->offset + i * PAGE_SIZE;
+        gen = m->gen;
+        local_irq_save(flags);
+        local_irq_enable();
+        ret = file_map_rw(m, (void *)page, PAGE_SIZE, pos, false);
+        local_irq_restore(flags);
+
+        m = file_map_recheck(addr, gen);
+        if ( ret < 0 || !m || m->pages[i] )
+        {
+            free_page((void *)page);
+            if ( ret < 0 )
+                printk("mmap: reading page %lx failed: %d\n", addr, errno);
+            /* Unmapped meanwhile: fault again.  Populated: just retry. */
+            return ret >= 0;
+        }
+        if ( ret < PAGE_SIZE )
+        {
+            memset((char *)page + ret, 0, PAGE_SIZE - ret);
+            if ( m->size < 0 || pos + ret < m->size )
+                m->size = pos + ret;
+        }
+        m->pages[i] = page;
+    }
+
+    if ( write && (m->flags & MAP_SHARED) )
+        m->pages[i] |= FILE_MAP_DIRTY;
+
+    return !remap_frame(addr & PAGE_MASK,
+                        virt_to_mfn(m->pages[i] & PAGE_MASK),
+                        file_map_prot(m, i));
+}
+
+/*
+ * Write back the dirty pages of m in [first, last).  Pages are write
+ * protected again before being written, so that stores meanwhile dirty
+ * them anew.
+ */
+static int file_map_sync(struct file_map *m, unsigned long first,
+                         unsigned long last)
+{
+    unsigned long i, va = m->va, gen = m->gen;
+    off_t pos;
+    size_t len;
+    int ret = 0;
+
+    for ( i = first; i < last; i++ )
+    {
+        if ( !(m->pages[i] & FILE_MAP_DIRTY) )
+            continue;
+
+        m->pages[i] &= ~FILE_MAP_DIRTY;
+        remap_frame(va + i * PAGE_SIZE,
+                    virt_to_mfn(m->pages[i]), L1_PROT_RO);
+        pos = m->offset + i * PAGE_SIZE;
+        len = PAGE_SIZE;
+        /* Do not extend the file with the zeroes past its end. */
+        if ( m->size >= 0 && m->size - pos < PAGE_SIZE )
+            len = m->size > pos ? m->size - pos : 0;
+        if ( len && file_map_rw(m, (void *)m->pages[i], len, pos, true) !=
+                    (ssize_t)len )
+            ret = -1;
+
+        m = file_map_recheck(va, gen);
+        if ( !m )
+            break;
+    }
+
+    return ret;
+}
+
+/*
+ * The fd of file is being closed.  If the file is still mapped, its mappings
+ * take it over, and munmap() of the last one closes it.  Returns whether the
+ * file has been taken over.
+ */
+static bool file_map_keep(struct file *file)
+{
+    struct file_map *m;
+    struct file *own = NULL;
+
+    for ( m = file_maps; m; m = m->next )
+    {
+        if ( m->file != file )
+            continue;
+        if ( !own )
+        {
+            own = malloc(sizeof(*own));
+            if ( !own )
+                break;
+            *own = *file;
+            init_waitqueue_head(&own->waitq);
+            own->epoll = NULL;
+        }
+        m->file = own;
+        m->own_file = true;
+    }
+
+    if ( m )
+    {
+        /* The fd slot will be reused, the mappings can't read it anymore. */
+        printk("mmap: no memory to keep closed file mapped\n");
+        for ( m = file_maps; m; m = m->next )
+            if ( m->file == file )
+                m->file = NULL;
+    }
+
+    return own;
+}
+
+static void *mmap_file(struct file *file, unsigned long n, int prot,
+                       int flags, off_t offset)
+{
+    const struct file_ops *ops = get_file_ops(file->type);
+    struct file_map *m;
+    unsigned long zero = 0;
+
+    if ( !ops->lseek )
+    {
+        errno = ENODEV;
+        return MAP_FAILED;
+    }
+    if ( !n || (offset & ~PAGE_MASK) ||
+         !(flags & (MAP_SHARED | MAP_PRIVATE)) )
+    {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    m = calloc(1, sizeof(*m) + n * sizeof(*m->pages));
+    if ( !m )
+    {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    m->va = (unsigned long)map_frames_ex(&zero, n, 0, 0, 1, DOMID_SELF, NULL,
+                                         L1_RESERVED);
+    if ( !m->va )
+    {
+        free(m);
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    m->n = n;
+    m->gen = ++file_map_gen;
+    m->file = file;
+    m->prot = prot;
+    m->flags = flags;
+    m->offset = offset;
+    m->size = -1;
+    m->next = file_maps;
+    file_maps = m;
+
+    return (void *)m->va;
+}
+
 void *mmap(void *start, size_t length, int prot, int flags, int fd, off_t offset)
 {
     unsigned long n = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    struct file *file;
 
     ASSERT(!start);
-    ASSERT(prot == (PROT_READ|PROT_WRITE));
-    ASSERT((fd == -1 && (flags == (MAP_SHARED|MAP_ANON) || flags == (MAP_PRIVATE|MAP_ANON)))
-        || (fd != -1 && flags == MAP_SHARED));
 
-    if (fd == -1)
+    if (fd == -1) {
+        ASSERT(prot == (PROT_READ|PROT_WRITE));
+        ASSERT(flags == (MAP_SHARED|MAP_ANON) || flags == (MAP_PRIVATE|MAP_ANON));
         return map_zero(n, 1);
-    else if (files[fd].type == FTYPE_MEM) {
+    }
+
+    file = get_file_from_fd(fd);
+    if (!file) {
+        errno = EBADF;
+        return MAP_FAILED;
+    }
+    if (file->type == FTYPE_MEM) {
         unsigned long first_mfn = offset >> PAGE_SHIFT;
+
+        ASSERT(prot == (PROT_READ|PROT_WRITE));
+        ASSERT(flags == MAP_SHARED);
         return map_frames_ex(&first_mfn, n, 0, 1, 1, DOMID_IO, NULL, _PAGE_PRESENT|_PAGE_RW);
-    } else ASSERT(0);
+    }
+
+    return mmap_file(file, n, prot, flags, offset);
 }
 EXPORT_SYMBOL(mmap);
 EXPORT_SYMBOL(mmap64);
 
+int msync(void *start, size_t length, int flags)
+{
+    unsigned long va = (unsigned long)start;
+    unsigned long end = va + length;
+    unsigned long first, last;
+    struct file_map *m;
+    int ret = 0;
+
+    if ( va & ~PAGE_MASK )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while ( va < end )
+    {
+        m = file_map_find(va);
+        if ( !m )
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        first = (va - m->va) >> PAGE_SHIFT;
+        last = (end - m->va + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        if ( last > m->n )
+            last = m->n;
+        /* m may be gone after writing back. */
+        va = m->va + last * PAGE_SIZE;
+        if ( (m->flags & MAP_SHARED) && file_map_sync(m, first, last) )
+            ret = -1;
+    }
+
+    if ( ret )
+        errno = EIO;
+    return ret;
+}
+EXPORT_SYMBOL(msync);
+
+static int munmap_file(struct file_map *m)
+{
+    struct file_map **pm;
+    struct file *file = NULL;
+    unsigned long i, gen = m->gen, va = m->va;
+
+    if ( m->flags & MAP_SHARED )
+    {
+        file_map_sync(m, 0, m->n);
+        m = file_map_recheck(va, gen);
+        if ( !m )
+            return 0;
+    }
+
+    for ( pm = &file_maps; *pm != m; pm = &(*pm)->next )
+        ;
+    *pm = m->next;
+
+    if ( m->own_file )
+    {
+        file = m->file;
+        for ( pm = &file_maps; *pm; pm = &(*pm)->next )
+            if ( (*pm)->file == file )
+                file = NULL;
+    }
+
+    unmap_frames(m->va, m->n);
+    for ( i = 0; i < m->n; i++ )
+        if ( m->pages[i] )
+            free_page((void *)(m->pages[i] & PAGE_MASK));
+    free(m);
+
+    /* The last mapping of a file whose fd has been closed. */
+    if ( file )
+    {
+        if ( get_file_ops(file->type)->close )
+            get_file_ops(file->type)->close(file);
+        free(file);
+    }
+
+    return 0;
+}
+
 int munmap(void *start, size_t length)
 {
     int total = length / PAGE_SIZE;
+    struct file_map *m = file_map_find((unsigned long)start);
     int ret;
 
+    if (m) {
+        /* File mappings can only be unmapped as a whole. */
+        if (m->va != (unsigned long)start ||
+            (length + PAGE_SIZE - 1) / PAGE_SIZE != m->n) {
+            errno = EINVAL;
+            return -1;
+        }
+        return munmap_file(m);
+    }
+
     ret = unmap_frames((unsigned long)start, (unsigned long)total);
     if (ret) {
         errno = ret;
@@ -1554,14 +2950,15 @@ const struct termios default_termios = {0,             /* iflag */
 
 int tcsetattr(int fildes, int action, const struct termios *tios)
 {
+    struct file *file = get_file_from_fd(fildes);
     struct consfront_dev *dev;
 
-    if (fildes < 0 || fildes >= NOFILE) {
+    if (!file) {
         errno = EBADF;
         return -1;
     }
 
-    if (files[fildes].type != FTYPE_CONSOLE) {
+    if (file->type != FTYPE_CONSOLE) {
         errno = ENOTTY;
         return -1;
     }
@@ -1581,7 +2978,7 @@ int tcsetattr(int fildes, int action, const struct termios *tios)
             return -1;
     }
 
-    dev = files[fildes].dev;
+    dev = file->dev;
     if (dev == NULL) {
         errno = ENOSYS;
         return -1;
@@ -1595,19 +2992,20 @@ EXPORT_SYMBOL(tcsetattr);
 
 int tcgetattr(int fildes, struct termios *tios)
 {
+    struct file *file = get_file_from_fd(fildes);
     struct consfront_dev *dev;
 
-    if (fildes < 0 || fildes >= NOFILE) {
+    if (!file) {
         errno = EBADF;
         return -1;
     }
 
-    if (files[fildes].type != FTYPE_CONSOLE) {
+    if (file->type != FTYPE_CONSOLE) {
         errno = ENOTTY;
         return -1;
     }
 
-    dev = files[fildes].dev;
+    dev = file->dev;
     if (dev == NULL) {
         errno = ENOSYS;
         return 0;
@@ -2,7 +2,7 @@
  * lwip-net.c
  *
  * interface between lwIP's ethernet and Mini-os's netfront.
- * For now, support only one network interface, as mini-os does.
+ * Each netfront device is brought up as its own lwIP netif.
  *
  * Tim Deegan <Tim.Deegan@eu.citrix.net>, July 2007
  * based on lwIP's ethernetif.c skeleton file, copyrights as below.
@@ -63,6 +63,7 @@
 #include "netif/etharp.h"
 
 #include <netfront.h>
+#include <xenbus.h>
 
 /* Define those to better describe your network interface. */
 #define IFNAME0 'e'
@@ -71,16 +72,31 @@
 #define IF_IPADDR	0x00000000
 #define IF_NETMASK	0x00000000
 
-/* Only have one network interface at a time. */
-static struct netif *the_interface = NULL;
+/* One per netfront device brought up by start_networking(). */
+struct netfront_if {
+  struct netif netif;
+  struct netfront_dev *dev;
+  unsigned char rawmac[6];
+#ifdef CONFIG_LWIP_RX_THREAD
+  struct wait_queue_head rx_queue;
+  struct semaphore rx_thread_done;
+#endif
+  struct netfront_if *next;
+};
 
-static unsigned char rawmac[6];
-static struct netfront_dev *dev;
+static struct netfront_if *netfront_ifs;
 
 /* Forward declarations. */
 static err_t netfront_output(struct netif *netif, struct pbuf *p,
              struct ip_addr *ipaddr);
 
+/* Called by netfront once the backend is done with a pbuf. */
+static void
+low_level_output_done(void *arg)
+{
+  pbuf_free(arg);
+}
+
 /*
  * low_level_output():
  *
@@ -90,12 +106,39 @@ static err_t netfront_output(struct netif *netif, struct pbuf *p,
  *
  */
 
+/*
+ * low_level_output_tcp():
+ *
+ * Tells whether the frame in p carries a TCP segment.  lwIP keeps TCP
+ * segments queued for retransmission and rewrites their headers in place
+ * when it sends them again, so they must not be granted to the backend.
+ * Everything else is left alone by lwIP once sent, until it is freed.
+ */
+
+static int
+low_level_output_tcp(struct pbuf *p)
+{
+  struct eth_hdr *ethhdr = p->payload;
+  struct ip_hdr *iphdr = (struct ip_hdr *)(ethhdr + 1);
+
+  if (p->len < sizeof(*ethhdr) + sizeof(*iphdr))
+    return 1;
+  return htons(ethhdr->type) == ETHTYPE_IP &&
+         IPH_PROTO(iphdr) == IP_PROTO_TCP;
+}
+
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
+  struct netfront_if *nf = netif->state;
+  struct netfront_dev *dev = nf->dev;
+  int tcp;
+
   if (!dev)
     return ERR_OK;
 
+  tcp = low_level_output_tcp(p);
+
 #ifdef ETH_PAD_SIZE
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
@@ -103,7 +146,14 @@ low_level_output(struct netif *netif, struct pbuf *p)
   /* Send the data from the pbuf to the interface, one pbuf at a
      time. The size of the data in each pbuf is kept in the ->len
      variable. */
-  if (!p->next) {
+  if (!p->next && !tcp && p->ref == 1 &&
+      (p->type == PBUF_RAM || p->type == PBUF_POOL)) {
+    /* Only one fragment owned by lwIP alone, and not one lwIP will write
+       to again: let the backend read it in place, keeping a reference
+       until it is released. */
+    pbuf_ref(p);
+    netfront_xmit_ref(dev, p->payload, p->len, low_level_output_done, p);
+  } else if (!p->next) {
     /* Only one fragment, can send it directly */
       netfront_xmit(dev, p->payload, p->len);
   } else {
@@ -207,9 +257,15 @@ netfront_input(struct netif *netif, unsigned char* data, int len)
     /* skip Ethernet header */
     pbuf_header(p, -(int16_t)sizeof(struct eth_hdr));
     /* pass to network layer */
+#ifdef CONFIG_LWIP_RX_THREAD
+    /* We are in netfront_rx_thread(), which owns the core lock.  Like
+       the tcpip thread, leave freeing p to the input function. */
+    netif->input(p, netif);
+#else
     if (tcpip_input(p, netif) == ERR_MEM)
       /* Could not store it, drop */
       pbuf_free(p);
+#endif
     break;
       
   case ETHTYPE_ARP:
@@ -232,23 +288,72 @@ netfront_input(struct netif *netif, unsigned char* data, int len)
  * function to pass up to lwIP.
  */
 
-void netif_rx(unsigned char* data, int len)
+void netif_rx(unsigned char* data, int len, void *arg)
 {
-  if (the_interface != NULL) {
-    netfront_input(the_interface, data, len);
+  struct netfront_if *nf = arg;
+
+  /* Devices not brought up by start_networking() have no netif. */
+  if (nf != NULL) {
+    netfront_input(&nf->netif, data, len);
     wake_up(&netfront_queue);
   }
   /* By returning, we ack the packet and relinquish the RX ring slot */
 }
 
+#ifdef CONFIG_LWIP_RX_THREAD
+static int rx_stop;
+
 /*
- * Set the IP, mask and gateway of the IF
+ * Receive in thread context rather than from the event handler: all
+ * packets pending on the ring are passed to lwIP directly, under one
+ * acquisition of the core lock, instead of being posted one by one to
+ * the tcpip thread's mailbox.
+ */
+static void
+netfront_rx_thread(void *arg)
+{
+  struct netfront_if *nf = arg;
+
+  while (1) {
+    wait_event(nf->rx_queue, rx_stop || netfront_rx_pending(nf->dev));
+    if (rx_stop)
+      break;
+    LOCK_TCPIP_CORE();
+    netfront_rx_poll(nf->dev);
+    UNLOCK_TCPIP_CORE();
+  }
+  up(&nf->rx_thread_done);
+}
+#endif
+
+/*
+ * Set the IP, mask and gateway of the n-th IF, in bring-up order.
+ */
+int networking_set_if_addr(unsigned int n, struct ip_addr *ipaddr,
+                           struct ip_addr *netmask, struct ip_addr *gw)
+{
+  struct netfront_if *nf;
+
+  for (nf = netfront_ifs; nf != NULL && n; nf = nf->next, n--)
+    ;
+  if (nf == NULL)
+    return -1;
+
+  netif_set_ipaddr(&nf->netif, ipaddr);
+  netif_set_netmask(&nf->netif, netmask);
+  netif_set_gw(&nf->netif, gw);
+  return 0;
+}
+EXPORT_SYMBOL(networking_set_if_addr);
+
+/*
+ * Set the IP, mask and gateway of the default IF
  */
 void networking_set_addr(struct ip_addr *ipaddr, struct ip_addr *netmask, struct ip_addr *gw)
 {
-  netif_set_ipaddr(the_interface, ipaddr);
-  netif_set_netmask(the_interface, netmask);
-  netif_set_gw(the_interface, gw);
+  netif_set_ipaddr(netif_default, ipaddr);
+  netif_set_netmask(netif_default, netmask);
+  netif_set_gw(netif_default, gw);
 }
 EXPORT_SYMBOL(networking_set_addr);
 
@@ -271,7 +376,9 @@ arp_timer(void *arg)
 err_t
 netif_netfront_init(struct netif *netif)
 {
-  unsigned char *mac = netif->state;
+  struct netfront_if *nf = netif->state;
+  unsigned char *mac = nf->rawmac;
+  static int arp_started;
 
 #if LWIP_SNMP
   /* ifType ethernetCsmacd(6) @see RFC1213 */
@@ -294,8 +401,6 @@ netif_netfront_init(struct netif *netif)
   netif->output = netfront_output;
   netif->linkoutput = low_level_output;
   
-  the_interface = netif;
-  
   /* set MAC hardware address */
   netif->hwaddr_len = 6;
   netif->hwaddr[0] = mac[0];
@@ -305,18 +410,18 @@ netif_netfront_init(struct netif *netif)
   netif->hwaddr[4] = mac[4];
   netif->hwaddr[5] = mac[5];
 
-  /* No interesting per-interface state */
-  netif->state = NULL;
-
   /* maximum transfer unit */
   netif->mtu = 1500;
   
   /* broadcast capability */
   netif->flags = NETIF_FLAG_BROADCAST;
 
-  etharp_init();
-
-  sys_timeout(ARP_TMR_INTERVAL, arp_timer, NULL);
+  /* The ARP table and its timer are shared by all interfaces. */
+  if (!arp_started) {
+    etharp_init();
+    sys_timeout(ARP_TMR_INTERVAL, arp_timer, NULL);
+    arp_started = 1;
+  }
 
   return ERR_OK;
 }
@@ -331,33 +436,40 @@ static void tcpip_bringup_finished(void *p)
   up(&tcpip_is_up);
 }
 
-/* 
- * Utility function to bring the whole lot up.  Call this from app_main() 
- * or similar -- it starts netfront and have lwIP start its thread,
- * which calls back to tcpip_bringup_finished(), which 
- * lets us know it's OK to continue.
+/*
+ * Bring up the netfront device at nodename as a new lwIP netif, addressed
+ * as configured in xenstore.
  */
-void start_networking(void)
+static struct netfront_if *
+netfront_if_start(char *nodename)
 {
-  struct netif *netif;
+  struct netfront_if *nf, **pnf;
   struct ip_addr ipaddr = { htonl(IF_IPADDR) };
   struct ip_addr netmask = { htonl(IF_NETMASK) };
   struct ip_addr gw = { 0 };
   char *ip = NULL, *netmask_str = NULL, *gw_str = NULL;
 
-  tprintk("Waiting for network.\n");
+  nf = xmalloc(struct netfront_if);
+  memset(nf, 0, sizeof(*nf));
 
-  dev = init_netfront(NULL, NULL, rawmac, &ip);
-  if (!dev) {
-      tprintk("Error initializing netfront.\n");
-      return;
+  nf->dev = init_netfront(nodename, NULL, nf->rawmac, &ip);
+  if (!nf->dev) {
+      tprintk("Error initializing netfront %s.\n", nodename);
+      xfree(nf);
+      return NULL;
   }
-  netmask_str = netfront_get_netmask(dev);
-  gw_str = netfront_get_gateway(dev);
+#ifdef CONFIG_LWIP_RX_THREAD
+  /* Before the rx handler is set, so no packet reaches lwIP from the
+     event handler. */
+  init_waitqueue_head(&nf->rx_queue);
+  init_SEMAPHORE(&nf->rx_thread_done, 0);
+  netfront_set_rx_poll(nf->dev, &nf->rx_queue);
+#endif
+  netmask_str = netfront_get_netmask(nf->dev);
+  gw_str = netfront_get_gateway(nf->dev);
   
   if (ip) {
     ipaddr.addr = inet_addr(ip);
-    free(ip);
 
     if (netmask_str) {
         netmask.addr = inet_addr(netmask_str);
@@ -372,33 +484,121 @@ void start_networking(void)
         else
             tprintk("Strange IP %s, leaving netmask to 0.\n", ip);
     }
+    free(ip);
 
     if (gw_str) {
         gw.addr = inet_addr(gw_str);
         free(gw_str);
     }
   }
-  tprintk("IP %x netmask %x gateway %x.\n",
+  tprintk("%s: IP %x netmask %x gateway %x.\n", nodename,
           ntohl(ipaddr.addr), ntohl(netmask.addr), ntohl(gw.addr));
-  
+
+  netif_add(&nf->netif, &ipaddr, &netmask, &gw, nf,
+            netif_netfront_init, ip_input);
+  netfront_set_rx_handler(nf->dev, netif_rx, nf);
+  netif_set_up(&nf->netif);
+#ifdef CONFIG_LWIP_RX_THREAD
+  create_thread("netfront-rx", netfront_rx_thread, nf);
+#endif
+
+  for (pnf = &netfront_ifs; *pnf != NULL; pnf = &(*pnf)->next)
+    ;
+  *pnf = nf;
+
+  return nf;
+}
+
+/* 
+ * Utility function to bring the whole lot up.  Call this from app_main() 
+ * or similar -- it starts netfront and have lwIP start its thread,
+ * which calls back to tcpip_bringup_finished(), which 
+ * lets us know it's OK to continue.
+ *
+ * Every vif is brought up.  lwIP sends to the interface whose subnet
+ * holds the destination, anything else goes to the default interface:
+ * the first one with a gateway, or else the first one.
+ */
+void start_networking(void)
+{
+  struct netfront_if *nf;
+  struct netif *def = NULL;
+  char **vifs = NULL, *msg;
+  char nodename[64];
+  int i;
+
+  tprintk("Waiting for network.\n");
+
   tprintk("TCP/IP bringup begins.\n");
   
-  netif = xmalloc(struct netif);
-  tcpip_init(tcpip_bringup_finished, netif);
-    
-  netif_add(netif, &ipaddr, &netmask, &gw, rawmac, 
-            netif_netfront_init, ip_input);
-  netif_set_default(netif);
-  netif_set_up(netif);
+  tcpip_init(tcpip_bringup_finished, NULL);
+
+  msg = xenbus_ls(XBT_NIL, "device/vif", &vifs);
+  if (msg) {
+    free(msg);
+    vifs = NULL;
+  }
+  if (vifs == NULL || vifs[0] == NULL) {
+    /* No vif listed yet: let netfront wait for the first one. */
+    nf = netfront_if_start("device/vif/0");
+    if (nf != NULL && nf->netif.gw.addr)
+      def = &nf->netif;
+  }
+  for (i = 0; vifs != NULL && vifs[i] != NULL; i++) {
+    snprintf(nodename, sizeof(nodename), "device/vif/%s", vifs[i]);
+    free(vifs[i]);
+    nf = netfront_if_start(nodename);
+    if (nf != NULL && nf->netif.gw.addr && def == NULL)
+      def = &nf->netif;
+  }
+  free(vifs);
+
+  if (def == NULL && netfront_ifs != NULL)
+    def = &netfront_ifs->netif;
+  if (def != NULL)
+    netif_set_default(def);
 
   down(&tcpip_is_up);
 
   tprintk("Network is ready.\n");
 }
 
+/*
+ * Remove a netif whose device was shut down.  This runs in the tcpip
+ * thread, after the packets the device had already passed to lwIP.
+ */
+static __DECLARE_SEMAPHORE_GENERIC(netfront_if_removed, 0);
+static void
+netfront_if_remove(void *arg)
+{
+  struct netfront_if *nf = arg;
+
+  netif_remove(&nf->netif);
+  xfree(nf);
+  up(&netfront_if_removed);
+}
+
 /* Shut down the network */
 void stop_networking(void)
 {
-  if (dev)
+  struct netfront_if *nf;
+  struct netfront_dev *dev;
+
+#ifdef CONFIG_LWIP_RX_THREAD
+  rx_stop = 1;
+  for (nf = netfront_ifs; nf != NULL; nf = nf->next) {
+    wake_up(&nf->rx_queue);
+    down(&nf->rx_thread_done);
+  }
+  rx_stop = 0;
+#endif
+  while ((nf = netfront_ifs) != NULL) {
+    netfront_ifs = nf->next;
+    /* low_level_output() drops packets from now on. */
+    dev = nf->dev;
+    nf->dev = NULL;
     shutdown_netfront(dev);
+    tcpip_callback(netfront_if_remove, nf);
+    down(&netfront_if_removed);
+  }
 }
@@ -16,6 +16,7 @@
 #include <mini-os/netfront.h>
 #include <mini-os/lib.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/trace.h>
 
 DECLARE_WAIT_QUEUE_HEAD(netfront_queue);
 
@@ -33,6 +34,9 @@ DECLARE_WAIT_QUEUE_HEAD(netfront_queue);
 struct net_buffer {
     void* page;
     grant_ref_t gref;
+    /* Last slot of a netfront_xmit_ref() packet. */
+    void (*done)(void *arg);
+    void *done_arg;
 };
 
 struct netfront_dev {
@@ -42,6 +46,9 @@ struct netfront_dev {
 
     unsigned short tx_freelist[NET_TX_RING_SIZE + 1];
     struct semaphore tx_sem;
+    /* Completed netfront_xmit_ref() slots, waiting for netfront_tx_reap(). */
+    unsigned short tx_done[NET_TX_RING_SIZE];
+    unsigned int tx_ndone;
 
     struct net_buffer rx_buffers[NET_RX_RING_SIZE];
     struct net_buffer tx_buffers[NET_TX_RING_SIZE];
@@ -67,6 +74,8 @@ struct netfront_dev {
 
     void (*netif_rx)(unsigned char* data, int len, void* arg);
     void *netif_rx_arg;
+    /* Poll mode: woken by the event handler, see netfront_set_rx_poll(). */
+    struct wait_queue_head *rx_waitq;
 
     unsigned char rawmac[6];
     char *ip;
@@ -81,10 +90,6 @@ static struct netfront_dev *dev_list = NULL;
 void init_rx_buffers(struct netfront_dev *dev);
 static struct netfront_dev *_init_netfront(struct netfront_dev *dev);
 static int _shutdown_netfront(struct netfront_dev *dev);
-void netfront_set_rx_handler(struct netfront_dev *dev,
-                             void (*thenetif_rx)(unsigned char *data, int len,
-                                                 void *arg),
-                             void *arg);
 
 static inline void add_id_to_freelist(unsigned int id,unsigned short* freelist)
 {
@@ -210,7 +215,11 @@ void network_tx_buf_gc(struct netfront_dev *dev)
             gnttab_end_access(buf->gref);
             buf->gref=GRANT_INVALID_REF;
 
-            add_id_to_freelist(id,dev->tx_freelist);
+            /* The done callback can't be called from interrupt context. */
+            if (buf->done)
+                dev->tx_done[dev->tx_ndone++] = id;
+            else
+                add_id_to_freelist(id,dev->tx_freelist);
             up(&dev->tx_sem);
         }
 
@@ -238,11 +247,38 @@ void netfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
     local_irq_save(flags);
 
     network_tx_buf_gc(dev);
-    network_rx(dev);
+    if (dev->rx_waitq)
+        wake_up(dev->rx_waitq);
+    else
+        network_rx(dev);
 
     local_irq_restore(flags);
 }
 
+/*
+ * Switch dev to poll mode: the event handler no longer receives packets
+ * but wakes up waitq, and the woken thread calls netfront_rx_poll() to
+ * pass all pending packets to the rx handler in thread context.
+ */
+void netfront_set_rx_poll(struct netfront_dev *dev,
+                          struct wait_queue_head *waitq)
+{
+    dev->rx_waitq = waitq;
+}
+EXPORT_SYMBOL(netfront_set_rx_poll);
+
+int netfront_rx_pending(struct netfront_dev *dev)
+{
+    return RING_HAS_UNCONSUMED_RESPONSES(&dev->rx);
+}
+EXPORT_SYMBOL(netfront_rx_pending);
+
+void netfront_rx_poll(struct netfront_dev *dev)
+{
+    network_rx(dev);
+}
+EXPORT_SYMBOL(netfront_rx_poll);
+
 #ifdef HAVE_LIBC
 void netfront_select_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
@@ -255,17 +291,43 @@ void netfront_select_handler(evtchn_port_t port, struct pt_regs *regs, void *dat
     local_irq_restore(flags);
 
     if ( file )
-        file->read = true;
+        file_set_events(file, POLLIN);
     wake_up(&netfront_queue);
 }
 #endif
 
+/*
+ * Call the done callbacks of completed netfront_xmit_ref() packets and
+ * return their slots to the freelist.  Thread context only.
+ */
+static void netfront_tx_reap(struct netfront_dev *dev)
+{
+    struct net_buffer *buf;
+    unsigned long flags;
+    unsigned short id;
+
+    local_irq_save(flags);
+    while (dev->tx_ndone) {
+        id = dev->tx_done[--dev->tx_ndone];
+        local_irq_restore(flags);
+
+        buf = &dev->tx_buffers[id];
+        buf->done(buf->done_arg);
+        buf->done = NULL;
+
+        local_irq_save(flags);
+        add_id_to_freelist(id, dev->tx_freelist);
+    }
+    local_irq_restore(flags);
+}
+
 static void free_netfront(struct netfront_dev *dev)
 {
     int i;
 
     for(i = 0; i < NET_TX_RING_SIZE; i++)
         down(&dev->tx_sem);
+    netfront_tx_reap(dev);
 
     mask_evtchn(dev->evtchn);
 
@@ -387,13 +449,11 @@ EXPORT_SYMBOL(netfront_get_gateway);
 static struct netfront_dev *_init_netfront(struct netfront_dev *dev)
 {
     int domid;
-    xenbus_transaction_t xbt;
+    struct xenbus_batch batch;
     char* err = NULL;
-    char* message=NULL;
     struct netif_tx_sring *txs;
     struct netif_rx_sring *rxs;
     char* msg = NULL;
-    int retry=0;
     int i;
     char path[256];
 
@@ -409,7 +469,9 @@ static struct netfront_dev *_init_netfront(struct netfront_dev *dev)
     for (i = 0; i < NET_TX_RING_SIZE; i++) {
         add_id_to_freelist(i, dev->tx_freelist);
         dev->tx_buffers[i].page = NULL;
+        dev->tx_buffers[i].done = NULL;
     }
+    dev->tx_ndone = 0;
 
     for (i = 0; i < NET_RX_RING_SIZE; i++) {
         /* TODO: that's a lot of memory */
@@ -441,60 +503,23 @@ static struct netfront_dev *_init_netfront(struct netfront_dev *dev)
 
     dev->events = NULL;
 
-again:
-    err = xenbus_transaction_start(&xbt);
-    if (err) {
-        printk("starting transaction\n");
-        free(err);
-    }
-
-    err = xenbus_printf(xbt, dev->nodename, "tx-ring-ref","%u",
+    xenbus_batch_init(&batch);
+    xenbus_batch_printf(&batch, dev->nodename, "tx-ring-ref", "%u",
                         dev->tx_ring_ref);
-    if (err) {
-        message = "writing tx ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, dev->nodename, "rx-ring-ref","%u",
+    xenbus_batch_printf(&batch, dev->nodename, "rx-ring-ref", "%u",
                         dev->rx_ring_ref);
+    xenbus_batch_printf(&batch, dev->nodename, "event-channel", "%u",
+                        dev->evtchn);
+    xenbus_batch_printf(&batch, dev->nodename, "request-rx-copy", "%u", 1);
+    xenbus_batch_printf(&batch, dev->nodename, "state", "%u",
+                        XenbusStateConnected);
+    err = xenbus_batch_commit(&batch);
+    xenbus_batch_free(&batch);
     if (err) {
-        message = "writing rx ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, dev->nodename, "event-channel", "%u", dev->evtchn);
-    if (err) {
-        message = "writing event-channel";
-        goto abort_transaction;
-    }
-
-    err = xenbus_printf(xbt, dev->nodename, "request-rx-copy", "%u", 1);
-    if (err) {
-        message = "writing request-rx-copy";
-        goto abort_transaction;
-    }
-
-    snprintf(path, sizeof(path), "%s/state", dev->nodename);
-    err = xenbus_switch_state(xbt, path, XenbusStateConnected);
-    if (err) {
-        message = "switching state";
-        goto abort_transaction;
-    }
-
-    err = xenbus_transaction_end(xbt, 0, &retry);
-    free(err);
-    if (retry) {
-        goto again;
-        printk("completing transaction\n");
+        printk("Error %s when connecting to backend\n", err);
+        goto error;
     }
 
-    goto done;
-
-abort_transaction:
-    free(err);
-    err = xenbus_transaction_end(xbt, 1, &retry);
-    printk("Abort transaction %s\n", message);
-    goto error;
-
-done:
     snprintf(path, sizeof(path), "%s/backend", dev->nodename);
     msg = xenbus_read(XBT_NIL, path, &dev->backend);
     snprintf(path, sizeof(path), "%s/mac", dev->nodename);
@@ -602,6 +627,7 @@ static const struct file_ops netfront_ops = {
     .write = netfront_write,
     .close = netfront_close_fd,
     .select_rd = select_read_flag,
+    .notify = true,
 };
 
 static unsigned int ftype_netfront;
@@ -782,8 +808,10 @@ void netfront_xmit(struct netfront_dev *dev, const unsigned char *data, int len)
     void* page;
 
     BUG_ON(len > PAGE_SIZE);
+    TRACE(NETFRONT_XMIT, (unsigned long)dev, len);
 
     down(&dev->tx_sem);
+    netfront_tx_reap(dev);
 
     local_irq_save(flags);
     id = get_id_from_freelist(dev->tx_freelist);
@@ -820,6 +848,70 @@ void netfront_xmit(struct netfront_dev *dev, const unsigned char *data, int len)
 }
 EXPORT_SYMBOL(netfront_xmit);
 
+/*
+ * Transmit a packet without copying it, by granting the pages holding it
+ * to the backend.  The data must not be modified until done(arg) is called,
+ * which happens from a later transmit on dev, or on shutdown, once the
+ * backend has released all pages.
+ */
+void netfront_xmit_ref(struct netfront_dev *dev, const unsigned char *data,
+                       int len, void (*done)(void *arg), void *arg)
+{
+    struct netif_tx_request *tx;
+    struct net_buffer *buf = NULL;
+    unsigned long flags;
+    unsigned int offset, size;
+    unsigned short id;
+    RING_IDX i;
+    int notify, left = len;
+
+    BUG_ON(len <= 0 || len > PAGE_SIZE);
+    TRACE(NETFRONT_XMIT, (unsigned long)dev, len);
+
+    /* One slot per page, the first one carrying the size of the packet. */
+    while (left) {
+        offset = (unsigned long)data & ~PAGE_MASK;
+        size = PAGE_SIZE - offset;
+        if (size > left)
+            size = left;
+
+        down(&dev->tx_sem);
+        netfront_tx_reap(dev);
+
+        local_irq_save(flags);
+        id = get_id_from_freelist(dev->tx_freelist);
+        local_irq_restore(flags);
+
+        buf = &dev->tx_buffers[id];
+        i = dev->tx.req_prod_pvt;
+        tx = RING_GET_REQUEST(&dev->tx, i);
+
+        buf->gref =
+            tx->gref = gnttab_grant_access(dev->dom, virt_to_mfn(data), 1);
+        tx->offset = offset;
+        tx->size = left == len ? len : size;
+        tx->flags = size < left ? NETTXF_more_data : 0;
+        tx->id = id;
+        dev->tx.req_prod_pvt = i + 1;
+
+        data += size;
+        left -= size;
+    }
+    buf->done_arg = arg;
+    buf->done = done;
+
+    wmb();
+
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->tx, notify);
+
+    if(notify) notify_remote_via_evtchn(dev->evtchn);
+
+    local_irq_save(flags);
+    network_tx_buf_gc(dev);
+    local_irq_restore(flags);
+}
+EXPORT_SYMBOL(netfront_xmit_ref);
+
 #ifdef HAVE_LIBC
 ssize_t netfront_receive(struct netfront_dev *dev, unsigned char *data, size_t len)
 {
@@ -836,7 +928,7 @@ ssize_t netfront_receive(struct netfront_dev *dev, unsigned char *data, size_t l
     network_rx(dev);
     if ( !dev->rlen && file )
         /* No data for us, make select stop returning */
-        file->read = false;
+        file_clear_events(file, POLLIN);
     /* Before re-enabling the interrupts, in case a packet just arrived in the
      * meanwhile. */
     local_irq_restore(flags);
@@ -860,3 +952,4 @@ void netfront_set_rx_handler(struct netfront_dev *dev,
     dev->netif_rx = thenetif_rx;
     dev->netif_rx_arg = arg;
 }
+EXPORT_SYMBOL(netfront_set_rx_handler);
@@ -45,6 +45,7 @@
 #include <mini-os/list.h>
 #include <mini-os/sched.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/trace.h>
 
 
 #ifdef SCHED_DEBUG
@@ -108,6 +109,8 @@ void schedule(void)
         /* handle pending events if any */
         force_evtchn_callback();
     } while(1);
+    if(prev != next)
+        TRACE(SCHEDULE, (unsigned long)prev, (unsigned long)next);
     local_irq_restore(flags);
     /* Interrupting the switch is equivalent to having the next thread
        inturrupted at the return instruction. And therefore at safe point. */
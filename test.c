@@ -190,6 +190,75 @@ static void periodic_thread(void *p)
     }
 }
 
+#ifdef STRING_BENCH
+/* Throughput of the memory functions used on all data paths. */
+#define STRING_BENCH_ORDER 4
+#define STRING_BENCH_BYTES (4 << 20)
+
+static unsigned long string_bench_rate(size_t bytes, s_time_t t)
+{
+    /* Bytes per nanosecond * 1000 = MB/s */
+    return t ? (uint64_t)bytes * 1000 / t : 0;
+}
+
+static void string_bench_size(char *dst, const char *src, size_t len)
+{
+    unsigned int i, iters = STRING_BENCH_BYTES / len;
+    s_time_t t_cpy, t_set, t_cmp;
+    volatile int res = 0;
+
+    t_cpy = NOW();
+    for ( i = 0; i < iters; i++ )
+        memcpy(dst, src, len);
+    t_cpy = NOW() - t_cpy;
+
+    t_cmp = NOW();
+    for ( i = 0; i < iters; i++ )
+        res |= memcmp(dst, src, len);
+    t_cmp = NOW() - t_cmp;
+
+    t_set = NOW();
+    for ( i = 0; i < iters; i++ )
+        memset(dst, i, len);
+    t_set = NOW() - t_set;
+
+    if ( res )
+        printk("string bench: memcmp mismatch after memcpy\n");
+    printk("string bench %6lu bytes %s: memcpy %5lu MB/s, memset %5lu MB/s, "
+           "memcmp %5lu MB/s\n", (unsigned long)len,
+           ((uintptr_t)dst | (uintptr_t)src) & 7 ? "unaligned" : "aligned  ",
+           string_bench_rate((size_t)iters * len, t_cpy),
+           string_bench_rate((size_t)iters * len, t_set),
+           string_bench_rate((size_t)iters * len, t_cmp));
+}
+
+static void string_bench(void *p)
+{
+    static const size_t sizes[] = { 64, 1514, PAGE_SIZE, 16 * PAGE_SIZE };
+    char *src, *dst;
+    unsigned int i;
+
+    src = (char *)alloc_pages(STRING_BENCH_ORDER);
+    dst = (char *)alloc_pages(STRING_BENCH_ORDER);
+    if ( !src || !dst )
+        goto out;
+
+    for ( i = 0; i < (PAGE_SIZE << STRING_BENCH_ORDER); i++ )
+        src[i] = i;
+
+    for ( i = 0; i < ARRAY_SIZE(sizes); i++ )
+        string_bench_size(dst, src, sizes[i]);
+    /* Misaligned and differently aligned buffers, e.g. packet payloads. */
+    string_bench_size(dst + 2, src + 1, PAGE_SIZE);
+
+ out:
+    if ( src )
+        free_pages(src, STRING_BENCH_ORDER);
+    if ( dst )
+        free_pages(dst, STRING_BENCH_ORDER);
+}
+#endif
+
 #ifdef CONFIG_NETFRONT
 static struct netfront_dev *net_dev;
 static struct semaphore net_sem = __SEMAPHORE_INITIALIZER(net_sem, 0);
@@ -664,6 +733,9 @@ int app_main(void *p)
     create_thread("xenbus_tester", xenbus_tester, p);
 #endif
     create_thread("periodic_thread", periodic_thread, p);
+#ifdef STRING_BENCH
+    create_thread("string_bench", string_bench, p);
+#endif
 #ifdef CONFIG_NETFRONT
     create_thread("netfront", netfront_thread, p);
 #endif
@@ -850,7 +850,7 @@ int tpm_tis_send(struct tpm_chip* tpm, uint8_t* buf, size_t len) {
 #ifdef HAVE_LIBC
    if ( file )
    {
-      file->read = false;
+      file_clear_events(file, POLLIN);
       file->offset = 0;
    }
 #endif
@@ -71,51 +71,28 @@ void tpmfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data) {
 #ifdef HAVE_LIBC
    if ( file )
    {
-      file->read = true;
+      file_set_events(file, POLLIN);
    }
 #endif
    wake_up(&dev->waitq);
 }
 
 static int publish_xenbus(struct tpmfront_dev* dev) {
-   xenbus_transaction_t xbt;
-   int retry;
+   struct xenbus_batch batch;
    char* err;
    /* Write the grant reference and event channel to xenstore */
-again:
-   if((err = xenbus_transaction_start(&xbt))) {
-      TPMFRONT_ERR("Unable to start xenbus transaction, error was %s\n", err);
+   xenbus_batch_init(&batch);
+   xenbus_batch_printf(&batch, dev->nodename, "ring-ref", "%u", (unsigned int) dev->ring_ref);
+   xenbus_batch_printf(&batch, dev->nodename, "event-channel", "%u", (unsigned int) dev->evtchn);
+   err = xenbus_batch_commit(&batch);
+   xenbus_batch_free(&batch);
+   if(err) {
+      TPMFRONT_ERR("Unable to write %s/ring-ref and event-channel, error was %s\n", dev->nodename, err);
       free(err);
       return -1;
    }
 
-   if((err = xenbus_printf(xbt, dev->nodename, "ring-ref", "%u", (unsigned int) dev->ring_ref))) {
-      TPMFRONT_ERR("Unable to write %s/ring-ref, error was %s\n", dev->nodename, err);
-      free(err);
-      goto abort_transaction;
-   }
-
-   if((err = xenbus_printf(xbt, dev->nodename, "event-channel", "%u", (unsigned int) dev->evtchn))) {
-      TPMFRONT_ERR("Unable to write %s/event-channel, error was %s\n", dev->nodename, err);
-      free(err);
-      goto abort_transaction;
-   }
-
-   if((err = xenbus_transaction_end(xbt, 0, &retry))) {
-      TPMFRONT_ERR("Unable to complete xenbus transaction, error was %s\n", err);
-      free(err);
-      return -1;
-   }
-   if(retry) {
-      goto again;
-   }
-
    return 0;
-abort_transaction:
-   if((err = xenbus_transaction_end(xbt, 1, &retry))) {
-      free(err);
-   }
-   return -1;
 }
 
 static int wait_for_backend_connect(xenbus_event_queue* events, char* path)
@@ -451,7 +428,7 @@ int tpmfront_send(struct tpmfront_dev* dev, const uint8_t* msg, size_t length)
 #ifdef HAVE_LIBC
    if ( file )
    {
-      file->read = false;
+      file_clear_events(file, POLLIN);
       file->offset = 0;
       dev->respgot = false;
    }
@@ -611,7 +588,7 @@ static int tpmfront_posix_fstat(struct file *file, struct stat *buf)
 
    /* If we have a response waiting, then read it now from the backend
     * so we can get its length*/
-   if ( dev->waiting || (file->read && !dev->respgot) )
+   if ( dev->waiting || ((file->events & POLLIN) && !dev->respgot) )
    {
       if ((rc = tpmfront_recv(dev, &dummybuf, &dummysz)) != 0) {
 	 errno = EIO;
@@ -0,0 +1,207 @@
+/* -*-  Mode:C; c-basic-offset:4; tab-width:4 -*-
+ *
+ * Binary tracepoints for hot paths.
+ *
+ * Events are logged as fixed size records into a ring buffer in memory,
+ * overwriting the oldest records when full.  Nothing is formatted at
+ * logging time; the buffer is decoded by trace_print() or written out in
+ * binary form by trace_dump().  Mini-OS runs on a single vcpu, so there is
+ * one buffer, protected by disabling interrupts.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/time.h>
+#include <mini-os/trace.h>
+#include <mini-os/export.h>
+
+/* Number of records in the buffer, must be a power of 2. */
+#define TRACE_RECORDS     2048
+
+static struct trace_record trace_buf[TRACE_RECORDS];
+static uint32_t trace_head;     /* Total number of records logged. */
+static uint32_t trace_tail;     /* Oldest record not discarded by reset. */
+
+uint32_t trace_mask = ~0U;
+EXPORT_SYMBOL(trace_mask);
+
+static const struct {
+    const char *name;
+    const char *fmt;
+} trace_events[TRACE_NR_EVENTS] = {
+#define TRACE_DESC(name, fmt) [TRACE_##name] = { #name, fmt },
+    TRACE_EVENTS(TRACE_DESC)
+#undef TRACE_DESC
+};
+
+void trace_record(unsigned int event, uint64_t a0, uint64_t a1, uint64_t a2,
+                  uint64_t a3)
+{
+    struct trace_record *rec;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    rec = trace_buf + (trace_head & (TRACE_RECORDS - 1));
+    rec->time = NOW();
+    rec->event = event;
+    rec->seq = trace_head++;
+    rec->arg[0] = a0;
+    rec->arg[1] = a1;
+    rec->arg[2] = a2;
+    rec->arg[3] = a3;
+    local_irq_restore(flags);
+}
+EXPORT_SYMBOL(trace_record);
+
+void trace_set_mask(uint32_t mask)
+{
+    trace_mask = mask;
+}
+EXPORT_SYMBOL(trace_set_mask);
+
+void trace_reset(void)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    trace_tail = trace_head;
+    local_irq_restore(flags);
+}
+EXPORT_SYMBOL(trace_reset);
+
+/* Stop logging and return the index of the oldest record still present. */
+static uint32_t trace_stop(uint32_t *mask, uint32_t *lost)
+{
+    unsigned long flags;
+    uint32_t first;
+
+    local_irq_save(flags);
+    *mask = trace_mask;
+    trace_mask = 0;
+    first = trace_tail;
+    *lost = 0;
+    if ( trace_head - first > TRACE_RECORDS )
+    {
+        *lost = trace_head - first - TRACE_RECORDS;
+        first = trace_head - TRACE_RECORDS;
+    }
+    local_irq_restore(flags);
+
+    return first;
+}
+
+void trace_print(void)
+{
+    const struct trace_record *rec;
+    uint32_t mask, lost, i;
+    char fmt[128];
+
+    i = trace_stop(&mask, &lost);
+    printk("trace: %u records, %u lost\n", trace_head - i, lost);
+    for ( ; i != trace_head; i++ )
+    {
+        rec = trace_buf + (i & (TRACE_RECORDS - 1));
+        snprintf(fmt, sizeof(fmt), "[%%llu] %%s %s\n",
+                 trace_events[rec->event].fmt);
+        printk(fmt, (unsigned long long)rec->time,
+               trace_events[rec->event].name,
+               (unsigned long long)rec->arg[0],
+               (unsigned long long)rec->arg[1],
+               (unsigned long long)rec->arg[2],
+               (unsigned long long)rec->arg[3]);
+    }
+    trace_mask = mask;
+}
+EXPORT_SYMBOL(trace_print);
+
+#ifdef HAVE_LIBC
+#include <unistd.h>
+
+static int trace_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t ret;
+
+    while ( len )
+    {
+        ret = write(fd, p, len);
+        if ( ret <= 0 )
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the buffer contents to fd, e.g. a 9pfs file or a console savefile.
+ * Logging is suspended while writing, as the write path itself may hit
+ * tracepoints.
+ */
+int trace_dump(int fd)
+{
+    struct trace_header hdr;
+    char name[TRACE_NAME_LEN];
+    uint32_t mask, lost, first, i;
+    int ret = -1;
+
+    first = trace_stop(&mask, &lost);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(struct trace_record);
+    hdr.nr_events = TRACE_NR_EVENTS;
+    hdr.nr_records = trace_head - first;
+    hdr.lost = lost;
+    if ( trace_write(fd, &hdr, sizeof(hdr)) )
+        goto out;
+
+    for ( i = 0; i < TRACE_NR_EVENTS; i++ )
+    {
+        memset(name, 0, sizeof(name));
+        strncpy(name, trace_events[i].name, sizeof(name) - 1);
+        if ( trace_write(fd, name, sizeof(name)) )
+            goto out;
+    }
+
+    /* The records wrap around the end of the buffer at most once. */
+    i = first;
+    while ( i != trace_head )
+    {
+        uint32_t idx = i & (TRACE_RECORDS - 1);
+        uint32_t n = TRACE_RECORDS - idx;
+
+        if ( n > trace_head - i )
+            n = trace_head - i;
+        if ( trace_write(fd, trace_buf + idx, n * sizeof(*trace_buf)) )
+            goto out;
+        i += n;
+    }
+    ret = 0;
+
+ out:
+    trace_mask = mask;
+    return ret;
+}
+EXPORT_SYMBOL(trace_dump);
+#endif
@@ -51,12 +51,30 @@ DECLARE_WAIT_QUEUE_HEAD(xenbus_watch_queue);
 static __DECLARE_SEMAPHORE_GENERIC(xb_write_sem, 1);
 
 xenbus_event_queue xenbus_events;
-static struct watch {
+struct watch {
     char *token;
     char *path;
     xenbus_event_queue *events;
+    xenbus_watch_cb_t cb;
+    void *data;
     struct watch *next;
-} *watches;
+};
+
+/* Watches are hashed by token for fast lookup on watch events. */
+#define WATCH_HASH_SIZE 32
+static struct watch *watches[WATCH_HASH_SIZE];
+
+/* A watch event as allocated by the xenstore thread. */
+struct watch_event {
+    /* Must be first, consumers of event queues free the event via path. */
+    struct xenbus_event event;
+    struct watch *watch;
+};
+
+/* Events of watches with callbacks, handled by the xenwatch thread. */
+static struct xenbus_event *watch_work, **watch_work_tail = &watch_work;
+static DECLARE_WAIT_QUEUE_HEAD(watch_work_waitq);
+static struct thread *xenwatch_thread;
 
 struct xenbus_req_info
 {
@@ -68,6 +86,40 @@ struct xenbus_req_info
 #define NR_REQS 32
 static struct xenbus_req_info req_info[NR_REQS];
 
+/*
+ * Read cache: values read outside of transactions below one of the
+ * cached paths are kept in memory.  Each cached path is watched, the
+ * watch events invalidate the affected entries.
+ */
+#define CACHE_TOKEN_PREFIX "xenbus-cache:"
+#define CACHE_MAX_ENTRIES  64
+
+static struct cache_entry {
+    char *path;
+    char *value;
+    struct cache_entry *next;
+} *cache_entries;
+static int nr_cache_entries;
+static struct cache_dir {
+    char *path;
+    char *token;
+    struct cache_dir *next;
+} *cache_dirs;
+/* Bumped on each invalidation, prevents caching of outdated replies. */
+static unsigned int cache_gen;
+/*
+ * Paths written inside transactions.  They are only invalidated once the
+ * transaction commits, as until then reads outside of it still return,
+ * and may cache, the old values.
+ */
+static struct cache_txn_path {
+    xenbus_transaction_t xbt;
+    char *path;
+    struct cache_txn_path *next;
+} *cache_txn_paths;
+/* A path couldn't be recorded, flush the whole cache on the next commit. */
+static bool cache_txn_lost;
+
 static char *errmsg(struct xsd_sockmsg *rep);
 
 uint32_t xenbus_evtchn;
@@ -108,6 +160,46 @@ static void memcpy_from_ring(const void *Ring, void *Dest, int off, int len)
     memcpy(dest + c1, ring, c2);
 }
 
+static unsigned int watch_hash(const char *token)
+{
+    unsigned int hash = 0;
+
+    while ( *token )
+        hash = hash * 31 + *token++;
+
+    return hash % WATCH_HASH_SIZE;
+}
+
+static struct watch *find_watch(const char *token)
+{
+    struct watch *watch;
+
+    for ( watch = watches[watch_hash(token)]; watch; watch = watch->next )
+        if ( !strcmp(watch->token, token) )
+            return watch;
+
+    return NULL;
+}
+
+static void xenwatch_thread_func(void *ign)
+{
+    struct watch_event *wevent;
+
+    for ( ;; )
+    {
+        wait_event(watch_work_waitq, watch_work);
+
+        wevent = (struct watch_event *)watch_work;
+        watch_work = wevent->event.next;
+        if ( !watch_work )
+            watch_work_tail = &watch_work;
+
+        wevent->watch->cb(wevent->event.path, wevent->event.token,
+                          wevent->watch->data);
+        free(wevent);
+    }
+}
+
 char **xenbus_wait_for_watch_return(xenbus_event_queue *queue)
 {
     struct xenbus_event *event;
@@ -285,6 +377,147 @@ static void xenbus_read_data(char *buf, unsigned int len)
     }
 }
 
+static int cache_path_match(const char *path, const char *prefix)
+{
+    size_t len = strlen(prefix);
+
+    /* An empty prefix matches all paths. */
+    return !len || (!strncmp(path, prefix, len) &&
+                    (path[len] == 0 || path[len] == '/'));
+}
+
+static void cache_free_entry(struct cache_entry *entry)
+{
+    free(entry->path);
+    free(entry->value);
+    free(entry);
+    nr_cache_entries--;
+}
+
+/* Drop all cached values at or below path. */
+static void cache_invalidate(const char *path)
+{
+    struct cache_entry *entry, **prev;
+
+    cache_gen++;
+
+    for ( prev = &cache_entries; (entry = *prev); )
+    {
+        if ( cache_path_match(entry->path, path) )
+        {
+            *prev = entry->next;
+            cache_free_entry(entry);
+        }
+        else
+            prev = &entry->next;
+    }
+}
+
+static int cache_covers(const char *path)
+{
+    struct cache_dir *dir;
+
+    for ( dir = cache_dirs; dir; dir = dir->next )
+        if ( cache_path_match(path, dir->path) )
+            return 1;
+
+    return 0;
+}
+
+/* path was modified by a request in xbt. */
+static void cache_modified(xenbus_transaction_t xbt, const char *path)
+{
+    struct cache_txn_path *txn;
+
+    if ( xbt == XBT_NIL )
+    {
+        cache_invalidate(path);
+        return;
+    }
+    if ( !cache_covers(path) )
+        return;
+
+    txn = malloc(sizeof(*txn));
+    if ( txn )
+        txn->path = strdup(path);
+    if ( !txn || !txn->path )
+    {
+        free(txn);
+        cache_txn_lost = true;
+        return;
+    }
+    txn->xbt = xbt;
+    txn->next = cache_txn_paths;
+    cache_txn_paths = txn;
+}
+
+/* Forget the paths written in xbt, invalidating them if it committed. */
+static void cache_txn_end(xenbus_transaction_t xbt, int commit)
+{
+    struct cache_txn_path *txn, **prev;
+
+    for ( prev = &cache_txn_paths; (txn = *prev); )
+    {
+        if ( txn->xbt != xbt )
+        {
+            prev = &txn->next;
+            continue;
+        }
+        if ( commit )
+            cache_invalidate(txn->path);
+        *prev = txn->next;
+        free(txn->path);
+        free(txn);
+    }
+
+    if ( commit && cache_txn_lost )
+    {
+        cache_invalidate("");
+        cache_txn_lost = false;
+    }
+}
+
+static char *cache_lookup(const char *path)
+{
+    struct cache_entry *entry;
+
+    for ( entry = cache_entries; entry; entry = entry->next )
+        if ( !strcmp(entry->path, path) )
+            return strdup(entry->value);
+
+    return NULL;
+}
+
+static void cache_insert(const char *path, const char *value)
+{
+    struct cache_entry *entry, **prev;
+
+    /* Make room by dropping the oldest entry, which is at the list end. */
+    if ( nr_cache_entries >= CACHE_MAX_ENTRIES )
+    {
+        for ( prev = &cache_entries; (*prev)->next; prev = &(*prev)->next );
+        cache_free_entry(*prev);
+        *prev = NULL;
+    }
+
+    /* Not caching the value is always fine. */
+    entry = malloc(sizeof(*entry));
+    if ( !entry )
+        return;
+    entry->path = strdup(path);
+    entry->value = strdup(value);
+    if ( !entry->path || !entry->value )
+    {
+        free(entry->path);
+        free(entry->value);
+        free(entry);
+        return;
+    }
+    entry->next = cache_entries;
+    cache_entries = entry;
+    nr_cache_entries++;
+}
+
 static void xenbus_thread_func(void *ign)
 {
     struct xsd_sockmsg msg;
@@ -304,13 +537,14 @@ static void xenbus_thread_func(void *ign)
 
         if ( msg.type == XS_WATCH_EVENT )
         {
-            struct xenbus_event *event = malloc(sizeof(*event) + msg.len);
-            xenbus_event_queue *events = NULL;
+            struct watch_event *wevent = malloc(sizeof(*wevent) + msg.len);
+            struct xenbus_event *event = &wevent->event;
+            xenbus_event_queue *events;
             struct watch *watch;
             char *c;
             int zeroes = 0;
 
-            data = (char *)event + sizeof(*event);
+            data = (char *)wevent + sizeof(*wevent);
             xenbus_read_data(data, msg.len);
 
             for ( c = data; c < data + msg.len; c++ )
@@ -327,25 +561,37 @@ static void xenbus_thread_func(void *ign)
             event->path = data;
             event->token = event->path + strlen(event->path) + 1;
 
-            for ( watch = watches; watch; watch = watch->next )
-                if ( !strcmp(watch->token, event->token) )
-                {
-                    events = watch->events;
-                    break;
-                }
-
-            if ( events )
+            if ( !strncmp(event->token, CACHE_TOKEN_PREFIX,
+                          strlen(CACHE_TOKEN_PREFIX)) )
             {
-                event->next = *events;
-                *events = event;
-                wake_up(&xenbus_watch_queue);
+                cache_invalidate(event->path);
+                free(event);
+                continue;
             }
-            else
+
+            watch = find_watch(event->token);
+            if ( !watch )
             {
                 printk("Xenstore: unexpected watch token %s\n", event->token);
                 free(event);
+                continue;
             }
 
+            event->next = NULL;
+            wevent->watch = watch;
+            if ( watch->cb )
+            {
+                *watch_work_tail = event;
+                watch_work_tail = &event->next;
+                wake_up(&watch_work_waitq);
+                continue;
+            }
+
+            /* Append the event, so it is delivered in order. */
+            for ( events = watch->events; *events; events = &(*events)->next );
+            *events = event;
+            wake_up(&xenbus_watch_queue);
+
             continue;
         }
 
@@ -423,6 +669,7 @@ static int allocate_xenbus_id(void)
     spin_unlock(&req_lock);
 
     init_waitqueue_head(&req_info[o_probe].waitq);
+    req_info[o_probe].reply = NULL;
 
     return o_probe;
 }
@@ -467,29 +714,37 @@ void resume_xenbus(int canceled)
     struct watch *watch;
     struct write_req req[2];
     struct xsd_sockmsg *rep;
+    int i;
 
     get_xenbus();
 
+    /* Xenstore contents may have changed while we were suspended. */
+    cache_invalidate("");
+
     unmask_evtchn(xenbus_evtchn);
 
     if ( !canceled )
     {
-        for ( watch = watches; watch; watch = watch->next )
+        for ( i = 0; i < WATCH_HASH_SIZE; i++ )
         {
-            req[0].data = watch->path;
-            req[0].len = strlen(watch->path) + 1;
-            req[1].data = watch->token;
-            req[1].len = strlen(watch->token) + 1;
-
-            rep = xenbus_msg_reply(XS_WATCH, XBT_NIL, req, ARRAY_SIZE(req));
-            msg = errmsg(rep);
-            if ( msg )
+            for ( watch = watches[i]; watch; watch = watch->next )
             {
-                xprintk("error on XS_WATCH: %s\n", msg);
-                free(msg);
+                req[0].data = watch->path;
+                req[0].len = strlen(watch->path) + 1;
+                req[1].data = watch->token;
+                req[1].len = strlen(watch->token) + 1;
+
+                rep = xenbus_msg_reply(XS_WATCH, XBT_NIL, req,
+                                       ARRAY_SIZE(req));
+                msg = errmsg(rep);
+                if ( msg )
+                {
+                    xprintk("error on XS_WATCH: %s\n", msg);
+                    free(msg);
+                }
+                else
+                    free(rep);
             }
-            else
-                free(rep);
         }
     }
 
@@ -581,25 +836,32 @@ static void xb_write(int type, int req_id, xenbus_transaction_t trans_id,
 }
 
 /*
- * Send a mesasge to xenbus, in the same fashion as xb_write, and
- * block waiting for a reply.  The reply is malloced and should be
- * freed by the caller.
+ * Send a message to xenbus, in the same fashion as xb_write, without
+ * waiting for the reply.  Returns the request id to be passed to
+ * xenbus_msg_collect().  Blocks if all request ids are in use.
  */
-struct xsd_sockmsg *xenbus_msg_reply(int type, xenbus_transaction_t trans,
-                                     struct write_req *io, int nr_reqs)
+int xenbus_msg_submit(int type, xenbus_transaction_t trans,
+                      struct write_req *io, int nr_reqs)
 {
     int id;
-    DEFINE_WAIT(w);
-    struct xsd_sockmsg *rep;
 
     id = allocate_xenbus_id();
-    add_waiter(w, req_info[id].waitq);
-
     xb_write(type, id, trans, io, nr_reqs);
 
-    schedule();
-    remove_waiter(w, req_info[id].waitq);
-    wake(current);
+    return id;
+}
+EXPORT_SYMBOL(xenbus_msg_submit);
+
+/*
+ * Wait for the reply of a request sent via xenbus_msg_submit() and
+ * release its id.  The reply is malloced and should be freed by the
+ * caller.
+ */
+struct xsd_sockmsg *xenbus_msg_collect(int id)
+{
+    struct xsd_sockmsg *rep;
+
+    wait_event(req_info[id].waitq, req_info[id].reply);
 
     rep = req_info[id].reply;
     BUG_ON(rep->req_id != id);
@@ -607,6 +869,18 @@ struct xsd_sockmsg *xenbus_msg_reply(int type, xenbus_transaction_t trans,
 
     return rep;
 }
+EXPORT_SYMBOL(xenbus_msg_collect);
+
+/*
+ * Send a mesasge to xenbus, in the same fashion as xb_write, and
+ * block waiting for a reply.  The reply is malloced and should be
+ * freed by the caller.
+ */
+struct xsd_sockmsg *xenbus_msg_reply(int type, xenbus_transaction_t trans,
+                                     struct write_req *io, int nr_reqs)
+{
+    return xenbus_msg_collect(xenbus_msg_submit(type, trans, io, nr_reqs));
+}
 EXPORT_SYMBOL(xenbus_msg_reply);
 
 static char *errmsg(struct xsd_sockmsg *rep)
@@ -672,13 +946,20 @@ char *xenbus_ls(xenbus_transaction_t xbt, const char *pre, char ***contents)
 }
 EXPORT_SYMBOL(xenbus_ls);
 
-char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
+int xenbus_read_submit(xenbus_transaction_t xbt, const char *path)
 {
     struct write_req req[] = { {path, strlen(path) + 1} };
+
+    return xenbus_msg_submit(XS_READ, xbt, req, ARRAY_SIZE(req));
+}
+EXPORT_SYMBOL(xenbus_read_submit);
+
+char *xenbus_read_collect(int id, char **value)
+{
     struct xsd_sockmsg *rep;
     char *res, *msg;
 
-    rep = xenbus_msg_reply(XS_READ, xbt, req, ARRAY_SIZE(req));
+    rep = xenbus_msg_collect(id);
     msg = errmsg(rep);
     if ( msg )
     {
@@ -694,19 +975,49 @@ char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
 
     return NULL;
 }
+EXPORT_SYMBOL(xenbus_read_collect);
+
+char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
+{
+    unsigned int gen;
+    char *msg;
+
+    if ( xbt != XBT_NIL || !cache_covers(path) )
+        return xenbus_read_collect(xenbus_read_submit(xbt, path), value);
+
+    *value = cache_lookup(path);
+    if ( *value )
+        return NULL;
+
+    gen = cache_gen;
+    msg = xenbus_read_collect(xenbus_read_submit(xbt, path), value);
+    if ( !msg && gen == cache_gen )
+        cache_insert(path, *value);
+
+    return msg;
+}
 EXPORT_SYMBOL(xenbus_read);
 
-char *xenbus_write(xenbus_transaction_t xbt, const char *path,
-                   const char *value)
+int xenbus_write_submit(xenbus_transaction_t xbt, const char *path,
+                        const char *value)
 {
     struct write_req req[] = {
         {path, strlen(path) + 1},
         {value, strlen(value)},
     };
+
+    cache_modified(xbt, path);
+
+    return xenbus_msg_submit(XS_WRITE, xbt, req, ARRAY_SIZE(req));
+}
+EXPORT_SYMBOL(xenbus_write_submit);
+
+char *xenbus_write_collect(int id)
+{
     struct xsd_sockmsg *rep;
     char *msg;
 
-    rep = xenbus_msg_reply(XS_WRITE, xbt, req, ARRAY_SIZE(req));
+    rep = xenbus_msg_collect(id);
     msg = errmsg(rep);
     if ( msg )
         return msg;
@@ -715,10 +1026,18 @@ char *xenbus_write(xenbus_transaction_t xbt, const char *path,
 
     return NULL;
 }
+EXPORT_SYMBOL(xenbus_write_collect);
+
+char *xenbus_write(xenbus_transaction_t xbt, const char *path,
+                   const char *value)
+{
+    return xenbus_write_collect(xenbus_write_submit(xbt, path, value));
+}
 EXPORT_SYMBOL(xenbus_write);
 
-char* xenbus_watch_path_token(xenbus_transaction_t xbt, const char *path,
-                              const char *token, xenbus_event_queue *events)
+static char *add_watch(xenbus_transaction_t xbt, const char *path,
+                       const char *token, xenbus_event_queue *events,
+                       xenbus_watch_cb_t cb, void *data)
 {
     struct xsd_sockmsg *rep;
     struct write_req req[] = {
@@ -726,16 +1045,16 @@ char* xenbus_watch_path_token(xenbus_transaction_t xbt, const char *path,
         {token, strlen(token) + 1},
     };
     struct watch *watch = malloc(sizeof(*watch));
+    struct watch **head = &watches[watch_hash(token)];
     char *msg;
 
-    if ( !events )
-        events = &xenbus_events;
-
     watch->token = strdup(token);
     watch->path = strdup(path);
     watch->events = events;
-    watch->next = watches;
-    watches = watch;
+    watch->cb = cb;
+    watch->data = data;
+    watch->next = *head;
+    *head = watch;
 
     rep = xenbus_msg_reply(XS_WATCH, xbt, req, ARRAY_SIZE(req));
 
@@ -747,8 +1066,29 @@ char* xenbus_watch_path_token(xenbus_transaction_t xbt, const char *path,
 
     return NULL;
 }
+
+char* xenbus_watch_path_token(xenbus_transaction_t xbt, const char *path,
+                              const char *token, xenbus_event_queue *events)
+{
+    if ( !events )
+        events = &xenbus_events;
+
+    return add_watch(xbt, path, token, events, NULL, NULL);
+}
 EXPORT_SYMBOL(xenbus_watch_path_token);
 
+char *xenbus_watch_path_token_cb(xenbus_transaction_t xbt, const char *path,
+                                 const char *token, xenbus_watch_cb_t cb,
+                                 void *data)
+{
+    if ( !xenwatch_thread )
+        xenwatch_thread = create_thread("xenwatch", xenwatch_thread_func,
+                                        NULL);
+
+    return add_watch(xbt, path, token, NULL, cb, data);
+}
+EXPORT_SYMBOL(xenbus_watch_path_token_cb);
+
 char* xenbus_unwatch_path_token(xenbus_transaction_t xbt, const char *path,
                                 const char *token)
 {
@@ -758,6 +1098,7 @@ char* xenbus_unwatch_path_token(xenbus_transaction_t xbt, const char *path,
         {token, strlen(token) + 1},
     };
     struct watch *watch, **prev;
+    struct xenbus_event *event, **pevent;
     char *msg;
 
     rep = xenbus_msg_reply(XS_UNWATCH, xbt, req, ARRAY_SIZE(req));
@@ -768,10 +1109,26 @@ char* xenbus_unwatch_path_token(xenbus_transaction_t xbt, const char *path,
 
     free(rep);
 
-    for ( prev = &watches, watch = *prev; watch;
+    for ( prev = &watches[watch_hash(token)], watch = *prev; watch;
           prev = &watch->next, watch = *prev)
         if ( !strcmp(watch->token, token) )
         {
+            /* Drop events not yet handled by the xenwatch thread. */
+            watch_work_tail = &watch_work;
+            for ( pevent = &watch_work; (event = *pevent); )
+            {
+                if ( ((struct watch_event *)event)->watch == watch )
+                {
+                    *pevent = event->next;
+                    free(event);
+                }
+                else
+                {
+                    watch_work_tail = &event->next;
+                    pevent = &event->next;
+                }
+            }
+
             free(watch->token);
             free(watch->path);
             *prev = watch->next;
@@ -789,6 +1146,8 @@ char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
     struct xsd_sockmsg *rep;
     char *msg;
 
+    cache_modified(xbt, path);
+
     rep = xenbus_msg_reply(XS_RM, xbt, req, ARRAY_SIZE(req));
     msg = errmsg(rep);
     if ( msg )
@@ -800,6 +1159,63 @@ char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
 }
 EXPORT_SYMBOL(xenbus_rm);
 
+char *xenbus_cache_path(const char *path)
+{
+    struct cache_dir *dir;
+    char *msg;
+
+    dir = malloc(sizeof(*dir));
+    if ( !dir )
+        return strdup("ENOMEM");
+    dir->path = strdup(path);
+    dir->token = malloc(strlen(CACHE_TOKEN_PREFIX) + strlen(path) + 1);
+    if ( !dir->path || !dir->token )
+    {
+        free(dir->token);
+        free(dir->path);
+        free(dir);
+        return strdup("ENOMEM");
+    }
+    sprintf(dir->token, "%s%s", CACHE_TOKEN_PREFIX, path);
+
+    msg = xenbus_watch_path_token(XBT_NIL, path, dir->token, NULL);
+    if ( msg )
+    {
+        free(dir->token);
+        free(dir->path);
+        free(dir);
+        return msg;
+    }
+
+    dir->next = cache_dirs;
+    cache_dirs = dir;
+
+    return NULL;
+}
+EXPORT_SYMBOL(xenbus_cache_path);
+
+char *xenbus_uncache_path(const char *path)
+{
+    struct cache_dir *dir, **prev;
+    char *msg = NULL;
+
+    for ( prev = &cache_dirs, dir = *prev; dir;
+          prev = &dir->next, dir = *prev )
+        if ( !strcmp(dir->path, path) )
+        {
+            *prev = dir->next;
+            msg = xenbus_unwatch_path_token(XBT_NIL, path, dir->token);
+            cache_invalidate(path);
+            free(dir->token);
+            free(dir->path);
+            free(dir);
+            break;
+        }
+
+    return msg;
+}
+EXPORT_SYMBOL(xenbus_uncache_path);
+
 char *xenbus_get_perms(xenbus_transaction_t xbt, const char *path, char **value)
 {
     struct write_req req[] = { {path, strlen(path) + 1} };
@@ -883,6 +1299,8 @@ char *xenbus_transaction_end(xenbus_transaction_t t, int abort, int *retry)
     req.len = 2;
     rep = xenbus_msg_reply(XS_TRANSACTION_END, t, &req, 1);
     err = errmsg(rep);
+    /* Only EAGAIN is known to have discarded the writes. */
+    cache_txn_end(t, !abort && (!err || strcmp(err, "EAGAIN")));
     if ( err )
     {
         if ( !strcmp(err, "EAGAIN") )
@@ -900,6 +1318,25 @@ char *xenbus_transaction_end(xenbus_transaction_t t, int abort, int *retry)
 }
 EXPORT_SYMBOL(xenbus_transaction_end);
 
+int xenbus_read_integer_collect(int id)
+{
+    char *res, *buf;
+    int t;
+
+    res = xenbus_read_collect(id, &buf);
+    if ( res )
+    {
+        free(res);
+        return -1;
+    }
+
+    sscanf(buf, "%d", &t);
+    free(buf);
+
+    return t;
+}
+EXPORT_SYMBOL(xenbus_read_integer_collect);
+
 int xenbus_read_integer(const char *path)
 {
     char *res, *buf;
@@ -977,6 +1414,88 @@ char *xenbus_printf(xenbus_transaction_t xbt, const char* node,
 }
 EXPORT_SYMBOL(xenbus_printf);
 
+void xenbus_batch_init(struct xenbus_batch *batch)
+{
+    batch->nr = 0;
+}
+EXPORT_SYMBOL(xenbus_batch_init);
+
+void xenbus_batch_printf(struct xenbus_batch *batch, const char *node,
+                         const char *path, const char *fmt, ...)
+{
+    char fullpath[BUFFER_SIZE];
+    char val[BUFFER_SIZE];
+    va_list args;
+
+    BUG_ON(batch->nr >= XENBUS_BATCH_MAX);
+
+    xenbus_build_path(node, path, fullpath);
+    va_start(args, fmt);
+    vsnprintf(val, sizeof(val), fmt, args);
+    va_end(args);
+
+    batch->entry[batch->nr].path = strdup(fullpath);
+    batch->entry[batch->nr].value = strdup(val);
+    batch->nr++;
+}
+EXPORT_SYMBOL(xenbus_batch_printf);
+
+/*
+ * Write all entries of the batch in one transaction.  All writes are
+ * issued without waiting for the individual replies.  If the transaction
+ * has to be retried the prepared batch is just submitted again.
+ */
+char *xenbus_batch_commit(struct xenbus_batch *batch)
+{
+    xenbus_transaction_t xbt;
+    int id[XENBUS_BATCH_MAX];
+    char *msg, *err;
+    int i, retry;
+
+    do {
+        msg = xenbus_transaction_start(&xbt);
+        if ( msg )
+            return msg;
+
+        for ( i = 0; i < batch->nr; i++ )
+            id[i] = xenbus_write_submit(xbt, batch->entry[i].path,
+                                        batch->entry[i].value);
+
+        for ( i = 0; i < batch->nr; i++ )
+        {
+            err = xenbus_write_collect(id[i]);
+            if ( msg )
+                free(err);
+            else
+                msg = err;
+        }
+
+        if ( msg )
+        {
+            free(xenbus_transaction_end(xbt, 1, &retry));
+            return msg;
+        }
+
+        msg = xenbus_transaction_end(xbt, 0, &retry);
+    } while ( !msg && retry );
+
+    return msg;
+}
+EXPORT_SYMBOL(xenbus_batch_commit);
+
+void xenbus_batch_free(struct xenbus_batch *batch)
+{
+    int i;
+
+    for ( i = 0; i < batch->nr; i++ )
+    {
+        free(batch->entry[i].path);
+        free(batch->entry[i].value);
+    }
+    batch->nr = 0;
+}
+EXPORT_SYMBOL(xenbus_batch_free);
+
 domid_t xenbus_get_self_id(void)
 {
     char *dom_id;